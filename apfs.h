@@ -19,6 +19,10 @@
 #define _APFS_MODULE_H
 
 #include <linux/fs.h>
+#include <linux/unicode.h>
+#include <linux/refcount.h>
+#include <linux/shrinker.h>
+#include <linux/workqueue.h>
 
 #include "apfs/types.h"
 #include "apfs/container.h"
@@ -27,40 +31,621 @@
 
 #define NSEC_TO_SEC     1000000000
 
+#ifndef EFSCORRUPTED
+#define EFSCORRUPTED    EUCLEAN     /* Filesystem is corrupted */
+#endif
+
+#define APFS_OMAP_CACHE_BITS    10
+#define APFS_OMAP_CACHE_MAX     16384
+
+/*
+ * Cache of the omap translations (oid, xid) -> paddr. An entry is a version
+ * of an object: it was written in the transaction 'xid' and it's the
+ * version seen by all the transactions up to 'max_xid', so the mounts of
+ * different snapshots share the entries of the objects that didn't change
+ * between them. The lookups are done under RCU without taking any lock, so
+ * they can be done in the RCU path walk; the lock is only taken to add and
+ * evict entries.
+ */
+#define APFS_OMAP_REFERENCED    0
+
+struct apfs_omap_entry {
+        struct hlist_node hash;
+        struct list_head lru;
+        struct rcu_head rcu;
+        unsigned long flags;
+        paddr_t tree;
+        oid_t oid;
+        xid_t xid;
+        xid_t max_xid;
+        paddr_t paddr;
+};
+
+struct apfs_omap_cache {
+        spinlock_t lock;
+        unsigned long count;
+        unsigned long max;
+        struct list_head lru;
+        struct hlist_head buckets[1 << APFS_OMAP_CACHE_BITS];
+};
+
+/*
+ * A block of the container read into its own pages. 'data' is the start
+ * of the block.
+ */
+struct apfs_buf {
+        struct page* page;
+        unsigned int order;
+        paddr_t paddr;
+        void* data;
+};
+
+#define APFS_NODE_CACHE_BITS    10
+#define APFS_NODE_CACHE_MAX     2048
+
+/*
+ * A B-Tree node read from the disk. The zones of the node are decoded when
+ * it's read. The nodes are shared through the node cache and they are
+ * released with apfs_node_put().
+ */
+#define APFS_NODE_REFERENCED    0
+
+struct apfs_node {
+        struct hlist_node hash;
+        struct list_head lru;
+        struct rcu_head rcu;
+        refcount_t refcnt;
+        unsigned long flags;
+
+        paddr_t paddr;
+        struct apfs_buf* buf;
+        struct apfs_btree_node_phys_t* phys;
+        u_int8_t* toc;
+        u_int8_t* keys;
+        u_int8_t* vals;
+        u_int32_t nkeys;
+        u_int16_t level;
+        u_int16_t btn_flags;
+};
+
+/*
+ * Cache of B-Tree nodes indexed by physical address. Like the omap cache,
+ * the lookups are done under RCU. The nodes are evicted following the LRU
+ * order, giving a second chance to the nodes used since the last scan.
+ */
+struct apfs_node_cache {
+        spinlock_t lock;
+        unsigned long count;
+        unsigned long max;
+        struct list_head lru;
+        struct hlist_head buckets[1 << APFS_NODE_CACHE_BITS];
+};
+
+/*
+ * Position in a B-Tree. nodes[0] is the root node and nodes[depth - 1] is
+ * the current leaf; index[] is the position of the cursor in each level.
+ * The nodes are kept between seeks, so the next seek doesn't read again
+ * the nodes of the path that didn't change.
+ */
+#define APFS_BTREE_MAX_DEPTH    16
+
+/*
+ * Leaf where the records of an object were last found. The seeks try it
+ * before descending from the root, and it's only used if it covers the
+ * searched key, so a stale hint just costs a failed check.
+ */
+struct apfs_btree_hint {
+        paddr_t paddr;
+        xid_t xid;
+};
+
+struct apfs_btree_cursor {
+        struct super_block* sb;
+        paddr_t root;
+        paddr_t omap;
+        xid_t xid;
+        int depth;
+        struct apfs_node* nodes[APFS_BTREE_MAX_DEPTH];
+        int index[APFS_BTREE_MAX_DEPTH];
+        u_int64_t range_oid;        /* Records followed by a range scan */
+        u_int8_t range_type;
+
+        struct apfs_btree_hint* hint;
+        bool hinted;                /* Only the leaf is loaded */
+        u_int64_t seek_oid;         /* Key of the last seek */
+        u_int8_t seek_type;
+        u_int64_t seek_sub;
+};
+
+/*
+ * Shape of a whole B-Tree, filled by apfs_btree_stats(). levels[] is
+ * indexed by the level of the nodes (0 for the leaves). The sizes of the
+ * keys and values of the leaves are counted in power of two buckets.
+ */
+#define APFS_STATS_SIZE_BUCKETS 13
+
+struct apfs_btree_level_stats {
+        u_int64_t nodes;
+        u_int64_t keys;
+        u_int64_t used;             /* Bytes out of the free space */
+};
+
+struct apfs_btree_stats {
+        int depth;
+        struct apfs_btree_info_t info;  /* As stored in the root node */
+        struct apfs_btree_level_stats levels[APFS_BTREE_MAX_DEPTH];
+        u_int64_t key_sizes[APFS_STATS_SIZE_BUCKETS];
+        u_int64_t val_sizes[APFS_STATS_SIZE_BUCKETS];
+};
+
+/*
+ * Per-cpu counters of the nodes found in the node cache and read from the
+ * disk, by level of the node. Only one of each APFS_HEAT_SAMPLE accesses
+ * is counted.
+ */
+#define APFS_HEAT_SAMPLE        16
+
+struct apfs_node_heat {
+        unsigned int tick;
+        unsigned long hits[APFS_BTREE_MAX_DEPTH];
+        unsigned long reads[APFS_BTREE_MAX_DEPTH];
+};
+
+/*
+ * Per-cpu latency histograms of the operations of a volume. The bucket 'b'
+ * counts the calls that took from 2^b to 2^(b+1) - 1 nanoseconds.
+ */
+enum apfs_lat_op {
+        APFS_LAT_LOOKUP,
+        APFS_LAT_READDIR,
+        APFS_LAT_READ,
+        APFS_LAT_INODE,
+        APFS_LAT_OMAP,
+        APFS_LAT_NR_OPS
+};
+
+#define APFS_LAT_BUCKETS        40
+
+struct apfs_latency {
+        unsigned long buckets[APFS_LAT_NR_OPS][APFS_LAT_BUCKETS];
+};
+
+/*
+ * Inodes with cached data (xattrs or directory listings), in LRU order. The
+ * caches of the inodes in the tail are released when there are more than
+ * 'max' or under memory pressure.
+ */
+#define APFS_XATTR_LRU_MAX      4096
+#define APFS_DIR_LRU_MAX        1024
+
+struct apfs_inode_lru {
+        spinlock_t lock;
+        unsigned long count;
+        unsigned long max;
+        struct list_head list;
+};
+
+/*
+ * A container with mounted volumes. It's shared by all the volumes mounted
+ * from the same block device, so the container omap is resolved only once.
+ * The omap translations of the container and of all its volumes (and their
+ * snapshots) are kept in the same cache.
+ */
+struct apfs_container {
+        struct list_head list;
+        int refcnt;                 /* Protected by apfs_containers_lock */
+        struct block_device* bdev;
+        struct apfs_superblock_t* raw;
+
+        oid_t oid;
+        xid_t xid;
+        u_int32_t block_size;
+        paddr_t omap_tree;
+        struct apfs_omap_cache omap_cache;
+
+        struct mutex sm_lock;
+        xid_t sm_xid;               /* Checkpoint of sm_free, 0 if not read */
+        u_int64_t sm_free;          /* Free blocks of all the devices */
+};
+
 /*
  * This structure is stored in the private data of the 
  * super_block structure.
  */
 struct apfs_glb_info {
-        oid_t cnt_oid;
-        xid_t cnt_xid;
+        struct apfs_container* cnt;
+        struct block_device* bdev;
+        unsigned int vol_index;     /* Index in apfs_superblock_t.fs_oid */
         
         oid_t vol_oid;
-        xid_t vol_xid;
+        xid_t vol_xid;              /* Transaction used to resolve the omap */
 
-        paddr_t cnt_omap_tree;
         paddr_t vol_omap_tree;
         paddr_t vol_root_tree;
+
+        char* snap_name;            /* Mounted snapshot, NULL for the live volume */
+        unsigned long omap_cache_max;
+        unsigned int dir_bloom_min; /* 0 disables the directory filters */
+
+        u_int64_t vol_incompat;
+
+        /* Counters of the volume superblock, for statfs */
+        u_int64_t vol_alloc_count;
+        u_int64_t vol_quota_count;  /* 0 if the volume has no quota */
+        u_int64_t vol_objects;
+        u_int64_t vol_fsid;
+#if IS_ENABLED(CONFIG_UNICODE)
+        struct unicode_map* encoding;
+#endif
+
+        struct apfs_node_cache node_cache;
+        struct apfs_inode_lru xattr_lru;
+        struct apfs_inode_lru dir_lru;
+        struct shrinker shrinker;
+
+        struct workqueue_struct* prefetch_wq;
+
+        struct apfs_node_heat __percpu* heat;   /* NULL if not allocated */
+        struct apfs_latency __percpu* latency;  /* NULL if not allocated */
+        struct dentry* debugfs_dir;
 };
 
+/*
+ * A decoded extended attribute. The value of the big stream-backed xattrs
+ * is not cached (value is NULL) and it's read from the disk each time.
+ */
+struct apfs_xattr {
+        char* name;
+        u_int8_t* value;
+        u_int16_t name_len;
+        u_int16_t flags;
+        u_int64_t size;
+        u_int64_t stream_oid;
+};
+
+struct apfs_xattr_cache {
+        refcount_t refcnt;
+        struct rcu_head rcu;
+        int count;
+        struct apfs_xattr xattrs[];
+};
+
+/*
+ * In-memory inode. The VFS inode is embedded in this structure.
+ */
+#define APFS_XATTRS_REFERENCED  0
+#define APFS_DIR_REFERENCED     1
+
+/*
+ * Bloom filter of the names of a directory, built the first time the whole
+ * directory is listed. A lookup of a name that is not in the filter is
+ * answered without reading the B-Tree. Only the directories with at least
+ * 'dir_bloom_min' entries get a filter.
+ */
+#define APFS_DIR_BLOOM_MIN          256
+#define APFS_DIR_BLOOM_BITS_ENTRY   10
+#define APFS_DIR_BLOOM_PROBES       4
+
+struct apfs_dir_bloom {
+        u_int32_t mask;             /* Number of bits - 1 */
+        unsigned long bits[];
+};
+
+/*
+ * A directory entry of a cached listing. The name is at 'name_off' in the
+ * names of the listing, without the null character.
+ */
+struct apfs_dirent {
+        u_int64_t ino;
+        loff_t pos;
+        u_int32_t name_off;
+        u_int16_t name_len;
+        u_int8_t type;              /* DT_* */
+};
+
+/*
+ * All the entries of a directory, sorted by position. The listings of the
+ * directory are served from it without reading the B-Tree.
+ */
+struct apfs_dir_cache {
+        refcount_t refcnt;
+        struct rcu_head rcu;
+        unsigned int count;
+        char* names;
+        struct apfs_dirent entries[];
+};
+
+/*
+ * The position of a directory entry is built from the hash of its name and
+ * its index among the entries with the same hash, so a listing can be
+ * resumed with a seek to the hash. It doesn't depend on any state of the
+ * open file, so any number of readers can list the directory at the same
+ * time. The positions fit in 31 bits; a directory is not expected to have
+ * more than APFS_DIR_POS_DUP_MAX names with the same hash.
+ */
+#define APFS_DIR_POS_FIRST      3
+#define APFS_DIR_POS_DUP_BITS   8
+#define APFS_DIR_POS_DUP_MAX    ((1 << APFS_DIR_POS_DUP_BITS) - 1)
+#define APFS_DIR_POS_EOF        0x7fffffff
+
+static inline loff_t apfs_drec_pos(u_int32_t hash, unsigned int dup)
+{
+        return ((loff_t) hash << APFS_DIR_POS_DUP_BITS
+                | min_t(unsigned int, dup, APFS_DIR_POS_DUP_MAX))
+            + APFS_DIR_POS_FIRST;
+}
+
+/*
+ * A decoded APFS_TYPE_FILE_EXTENT record. The logical address and the
+ * length are in bytes; a physical block of zero is a hole.
+ */
+struct apfs_extent {
+        u_int64_t logical;
+        u_int64_t len;
+        u_int64_t phys;
+};
+
+/*
+ * Files of a directory opened in the order of its listing. 'last' is the
+ * position of the last file opened and 'queued' the last position whose
+ * prefetch was queued.
+ */
+struct apfs_seq_state {
+        spinlock_t lock;
+        int last;
+        int hits;
+        int queued;
+};
+
+struct apfs_inode_info {
+        struct mutex xattr_lock;
+        struct apfs_xattr_cache __rcu* xattrs;
+        struct list_head xattr_lru;
+        unsigned long flags;
+
+        struct apfs_btree_hint rec_hint;    /* Leaf of the inode record */
+        struct apfs_btree_hint data_hint;   /* Leaf of the last extent or
+                                               directory record */
+        spinlock_t ext_lock;
+        struct apfs_extent ext[2];  /* Last extent found and the next one */
+
+        struct apfs_dir_bloom __rcu* dir_bloom;
+        struct apfs_dir_cache __rcu* dir_cache;
+        struct list_head dir_lru;
+        struct apfs_seq_state seq;
+
+        struct inode vfs_inode;
+};
+
+static inline struct apfs_inode_info* APFS_I(struct inode* inode)
+{
+        return container_of(inode, struct apfs_inode_info, vfs_inode);
+}
+
+/*
+ * Inodes found while a directory is listed. Their records are read later
+ * in a single sorted pass.
+ */
+#define APFS_INO_BATCH_SIZE     128
+
+struct apfs_ino_batch_entry {
+        u_int64_t ino;
+        u_int16_t mode;
+};
+
+struct apfs_ino_batch {
+        int count;
+        struct apfs_ino_batch_entry entries[APFS_INO_BATCH_SIZE];
+};
+
+/*
+ * btree.c
+ */
+void apfs_btree_cursor_init(struct apfs_btree_cursor* cur,
+        struct super_block* sb, paddr_t root, paddr_t omap, xid_t xid);
+
+void apfs_fstree_cursor_init(struct apfs_btree_cursor* cur,
+        struct super_block* sb);
+
+void apfs_btree_cursor_hint(struct apfs_btree_cursor* cur,
+        struct apfs_btree_hint* hint);
+
+void apfs_btree_cursor_release(struct apfs_btree_cursor* cur);
+
+int apfs_btree_seek(struct apfs_btree_cursor* cur, u_int64_t oid,
+        u_int8_t type, u_int64_t sub);
+
+int apfs_btree_seek_ge(struct apfs_btree_cursor* cur, u_int64_t oid,
+        u_int8_t type, u_int64_t sub);
+
+int apfs_btree_next(struct apfs_btree_cursor* cur);
+
+int apfs_btree_prev(struct apfs_btree_cursor* cur);
+
+int apfs_btree_range_first(struct apfs_btree_cursor* cur, u_int64_t oid,
+        u_int8_t type);
+
+int apfs_btree_range_from(struct apfs_btree_cursor* cur, u_int64_t oid,
+        u_int8_t type, u_int64_t sub);
+
+int apfs_btree_range_next(struct apfs_btree_cursor* cur);
+
+void* apfs_btree_key(struct apfs_btree_cursor* cur, int* len);
+
+void* apfs_btree_val(struct apfs_btree_cursor* cur, int* len);
+
+void apfs_btree_key_id(struct apfs_btree_cursor* cur, u_int64_t* oid,
+        u_int8_t* type);
+
+int apfs_btree_stats(struct apfs_btree_cursor* cur,
+        struct apfs_btree_stats* stats);
+
+/*
+ * cache.c
+ */
+void apfs_omap_cache_init(struct apfs_omap_cache* cache, unsigned long max);
+
+void apfs_omap_cache_destroy(struct apfs_omap_cache* cache);
+
+paddr_t apfs_omap_cache_lookup(struct apfs_omap_cache* cache, paddr_t tree,
+        oid_t oid, xid_t xid);
+
+void apfs_omap_cache_insert(struct apfs_omap_cache* cache, paddr_t tree,
+        oid_t oid, xid_t xid, xid_t max_xid, paddr_t paddr);
+
+void apfs_node_cache_init(struct apfs_node_cache* cache, unsigned long max);
+
+void apfs_node_cache_destroy(struct apfs_node_cache* cache);
+
+struct apfs_node* apfs_node_get(struct super_block* sb, paddr_t paddr);
+
+struct apfs_node* apfs_node_get_uncached(struct super_block* sb,
+        paddr_t paddr);
+
+void apfs_node_put(struct apfs_node* node);
+
+void apfs_inode_lru_init(struct apfs_inode_lru* lru, unsigned long max);
+
+unsigned long apfs_lru_walk(struct list_head* head, unsigned long count,
+        unsigned long nr, bool (*evict)(struct list_head* entry, void* arg),
+        void* arg);
+
+int apfs_register_shrinker(struct apfs_glb_info* glb_info);
+
+void apfs_unregister_shrinker(struct apfs_glb_info* glb_info);
+
+/*
+ * container.c
+ */
+struct apfs_container* apfs_get_container(struct super_block* sb,
+        unsigned long omap_max);
+
+void apfs_put_container(struct apfs_container* cnt);
+
+int apfs_container_free_blocks(struct super_block* sb, u_int64_t* free);
+
+/*
+ * dentry.c
+ */
+extern const struct dentry_operations apfs_ci_dentry_operations;
+
+int apfs_name_cmp(struct super_block* sb, const char* name, unsigned int len,
+        const char* str);
+
+u_int32_t apfs_name_hash(struct super_block* sb, const char* name,
+        unsigned int len);
+
 /*
  * dir.c
  */
 extern struct file_operations apfs_dir_operations;
 
+bool apfs_dir_may_contain(struct inode* dir, const struct qstr* name);
+
+unsigned long apfs_dir_lru_shrink(struct apfs_inode_lru* lru,
+        unsigned long nr);
+
+void apfs_drop_dir_cache(struct inode* inode);
+
 /*
  * file.c
  */
 extern struct file_operations apfs_file_operations;
+extern const struct address_space_operations apfs_aops;
+
+int apfs_find_extent(struct apfs_btree_cursor* cur, u_int64_t oid,
+        u_int64_t offset, struct apfs_extent* ext);
 
 /*
  * inode.c
  */
 extern struct inode_operations apfs_inode_operations;
+extern struct inode_operations apfs_symlink_inode_operations;
  
 struct inode* get_apfs_inode(struct super_block* sb, 
         struct inode* parent, uint64_t i_no, int inode_type);
 
+void apfs_prefetch_inodes(struct inode* dir, struct apfs_ino_batch* batch);
+
+/*
+ * xattr.c
+ */
+extern const struct xattr_handler* apfs_xattr_handlers[];
+
+ssize_t apfs_listxattr(struct dentry* dentry, char* buffer, size_t size);
+
+int apfs_xattr_get(struct inode* inode, const char* name, void* buffer,
+        size_t size);
+
+unsigned long apfs_xattr_lru_shrink(struct apfs_inode_lru* lru,
+        unsigned long nr);
+
+void apfs_drop_xattrs(struct inode* inode);
+
+/*
+ * io.c
+ */
+struct apfs_buf* apfs_read_block(struct super_block* sb, paddr_t paddr);
+
+struct apfs_buf* apfs_read_super_block(struct super_block* sb);
+
+int apfs_read_data_page(struct super_block* sb, struct page* page,
+        u_int64_t pos);
+
+struct bio* apfs_data_bio_alloc(struct super_block* sb, u_int64_t pos,
+        unsigned int nr_pages);
+
+void apfs_release_block(struct apfs_buf* buf);
+
+/*
+ * prefetch.c
+ */
+void apfs_seq_open(struct file* filp);
+
+/*
+ * export.c
+ */
+extern const struct export_operations apfs_export_ops;
+
+/*
+ * debug.c
+ */
+void apfs_debugfs_init(void);
+
+void apfs_debugfs_exit(void);
+
+void apfs_debugfs_register(struct super_block* sb);
+
+void apfs_debugfs_unregister(struct super_block* sb);
+
+void apfs_lat_record(struct super_block* sb, enum apfs_lat_op op,
+        u_int64_t start);
+
+/*
+ * util_test.c
+ */
+#ifdef APFS_KUNIT_TEST
+void apfs_kunit_init(void);
+
+void apfs_kunit_exit(void);
+#else
+static inline void apfs_kunit_init(void) {}
+
+static inline void apfs_kunit_exit(void) {}
+#endif
+
+/*
+ * ioctl.c
+ */
+long apfs_dir_ioctl(struct file* filp, unsigned int cmd, unsigned long arg);
+
+/*
+ * snapshot.c
+ */
+int apfs_find_snapshot(struct super_block* sb,
+        struct apfs_vol_superblock_t* apfs_vol, paddr_t omap_snap_tree,
+        const char* name, xid_t* xid, paddr_t* sblock);
+
 /*
  * util.h
  */
@@ -78,18 +663,36 @@ inline u_int8_t* get_key_zone(struct apfs_btree_node_phys_t* node);
 u_int64_t get_phys_block(struct super_block* sb, paddr_t omap, 
         u_int64_t oid, u_int64_t xid);
 
+u_int64_t get_phys_block_uncached(struct super_block* sb, paddr_t omap,
+        u_int64_t oid, u_int64_t xid);
+
+#define CMP_NODE_NONLEAF    0
+#define CMP_NODE_LEAF       1
+
+int cmp_omap_toc_keys(u_int64_t oid, u_int64_t xid,
+        u_int64_t oid_c, u_int64_t xid_c, u_int8_t node_type);
+
+int cmp_fstree_toc_keys(u_int64_t oid, u_int64_t otype, char* name,
+        u_int64_t oid_c, u_int64_t otype_c, char* name_c,
+        u_int8_t type);
+
+int get_omap_key(struct apfs_btree_node_phys_t* node, int pos,
+        u_int64_t* oid, u_int64_t* xid);
+
+u_int64_t get_omap_value(struct super_block* sb,
+        struct apfs_btree_node_phys_t* node, struct apfs_kvoff_t* toc);
+
 u_int8_t* find_in_node(struct super_block* sb,
         struct apfs_btree_node_phys_t* node, u_int64_t f_val, u_int64_t s_val,
         char* t_val, u_int8_t tree_type);
 
+struct apfs_record_inode_val_t* copy_inode_val(void* val, int len);
+
 struct apfs_record_inode_val_t* get_inode_from_disk(struct super_block* sb,
-        u_int64_t i_no);
+        u_int64_t i_no, struct apfs_btree_hint* hint);
 
 u_int64_t get_inode_size (struct apfs_record_inode_val_t* inode);
 
-struct buffer_head* get_inode_branch(struct super_block* sb,
-        u_int64_t i_no);
-
 char* normalize_string(char* unicode_string);
 
 u_int64_t get_fstree_value(struct super_block* sb, 
@@ -97,8 +700,5 @@ u_int64_t get_fstree_value(struct super_block* sb,
 
 int get_fstree_key(struct apfs_btree_node_phys_t* node, int pos, 
         u_int64_t* oid, u_int64_t* type, char** name);
-        
-struct buffer_head* get_fstree_child (struct super_block* sb,
-        struct apfs_btree_node_phys_t* node, struct apfs_kvloc_t* kvloc);
 
 #endif /* _APFS_MODULE_H */
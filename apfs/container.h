@@ -104,4 +104,38 @@ struct apfs_checkpoint_map_phys_t {
     struct apfs_checkpoint_mapping_t cpm_map[];
 };
 
+/*
+ * The highest bit of xp_desc_blocks is set when the checkpoint descriptor
+ * area is not contiguous.
+ */
+#define APFS_XP_DESC_BLOCKS_MASK    0x7fffffff
+
+/*
+ * The space manager keeps the free block counters of the container. Its
+ * oid is ephemeral, so its location is found in the checkpoint maps.
+ */
+#define APFS_SD_MAIN    0
+#define APFS_SD_TIER2   1
+#define APFS_SD_COUNT   2
+
+struct apfs_spaceman_device_t {
+    u_int64_t sm_block_count;
+    u_int64_t sm_chunk_count;
+    u_int32_t sm_cib_count;
+    u_int32_t sm_cab_count;
+    u_int64_t sm_free_count;
+    u_int32_t sm_addr_offset;
+    u_int32_t sm_reserved;
+    u_int64_t sm_reserved2;
+};
+
+struct apfs_spaceman_phys_t {
+    apfs_obj_header_t obj_h;
+    u_int32_t sm_block_size;
+    u_int32_t sm_blocks_per_chunk;
+    u_int32_t sm_chunks_per_cib;
+    u_int32_t sm_cibs_per_cab;
+    struct apfs_spaceman_device_t sm_dev[APFS_SD_COUNT];
+};
+
 #endif /* _APFS_CONTAINER_H */
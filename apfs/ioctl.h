@@ -0,0 +1,70 @@
+/* 
+ * This file is part of the APFS-Module.
+ * Copyright (c) 2019 Jordi Barcons.
+ * 
+ * This program is free software: you can redistribute it and/or modify  
+ * it under the terms of the GNU General Public License as published by  
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but 
+ * WITHOUT ANY WARRANTY; without even the implied warranty of 
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU 
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _APFS_IOCTL_H
+#define _APFS_IOCTL_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Interface with the user space. This header can be included by the
+ * programs that use the ioctls of the module.
+ */
+
+/*
+ * Attributes of an inode returned by APFS_IOC_BULKSTAT. The times are in
+ * nanoseconds since the epoch.
+ */
+struct apfs_bulkstat {
+    __u64 ino;
+    __u64 parent;
+    __u64 size;
+    __u64 crtime;
+    __u64 mtime;
+    __u64 ctime;
+    __u64 atime;
+    __u32 mode;
+    __u32 nlink;                /* Number of children for directories */
+};
+
+/*
+ * Return the whole subtree of the directory instead of its children. It
+ * needs CAP_SYS_ADMIN; listing the children needs read and search
+ * permission on the directory.
+ */
+#define APFS_BULKSTAT_SUBTREE   0x00000001
+
+/*
+ * Request of APFS_IOC_BULKSTAT. 'cookie' must be zero in the first call
+ * and kept between calls; 'done' is set when there are no more inodes.
+ * The children of a directory are returned in the order of its directory
+ * records, and the inodes of a subtree in the order of the inode numbers.
+ */
+struct apfs_bulkstat_req {
+    __u64 cookie;               /* In/out: where the next call starts */
+    __u64 buf;                  /* Array of struct apfs_bulkstat */
+    __u32 buf_count;            /* Size of the array */
+    __u32 flags;                /* APFS_BULKSTAT_* */
+    __u32 count;                /* Out: entries filled */
+    __u32 done;                 /* Out: no more entries */
+};
+
+#define APFS_IOC_MAGIC          0xAF
+#define APFS_IOC_BULKSTAT       _IOWR(APFS_IOC_MAGIC, 1, struct apfs_bulkstat_req)
+
+#endif /* _APFS_IOCTL_H */
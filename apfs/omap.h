@@ -58,4 +58,17 @@ struct apfs_omap_val_t {
     paddr_t ov_paddr;
 };
 
+/*
+ * A value in the omap snapshot B-Tree. The keys are the xid of the
+ * snapshots.
+ */
+#define APFS_OMAP_SNAPSHOT_DELETED  0x00000001
+#define APFS_OMAP_SNAPSHOT_REVERTED 0x00000002
+
+struct apfs_omap_snapshot_t {
+    u_int32_t oms_flags;
+    u_int32_t oms_pad;
+    oid_t oms_oid;
+};
+
 #endif /* _APFS_OMAP_H */
@@ -24,6 +24,7 @@
 #define APFS_OBJ_TYPE_CONTAINER         0x01    /* APFS container superblock */
 #define APFS_OBJ_TYPE_ROOT_NODE         0x02    /* B-Tree root node */
 #define APFS_OBJ_TYPE_NODE              0x03    /* B-Tree non-root node */
+#define APFS_OBJ_TYPE_SPACEMAN          0x05    /* Space manager */
 #define APFS_OBJ_TYPE_OMAP              0x0B
 #define APFS_OBJ_TYPE_FS                0x0D
 #define APFS_OBJ_TYPE_FSTREE            0x0E
@@ -27,9 +27,18 @@
 #define APFS_MAX_HIST           8
 #define APFS_VOLNAME_LEN        256
 #define APFS_MODIFIED_NAMELEN   32
+#define APFS_NAME_LEN           255     /* Max bytes of a file name */
 
 #define ROOT_DIR_INO_NUM        2
 
+/*
+ * Flags to be used in apfs_vol_superblock_t.apfs_incompatible_features.
+ */
+#define APFS_INCOMPAT_CASE_INSENSITIVE          0x00000001ULL
+#define APFS_INCOMPAT_DATALESS_SNAPS            0x00000002ULL
+#define APFS_INCOMPAT_ENC_ROLLED                0x00000004ULL
+#define APFS_INCOMPAT_NORMALIZATION_INSENSITIVE 0x00000008ULL
+
 /*
  * The types of a file-system records.
  */
@@ -166,6 +175,21 @@ struct apfs_record_drec_key_t {
     u_int8_t name[0];
 } __attribute__((packed));
 
+/*
+ * The same key seen as a hashed key, the format used by the volumes
+ * insensitive to normalization. The records of a directory are sorted by
+ * name_len_and_hash.
+ */
+struct apfs_record_drec_hashed_key_t {
+    struct apfs_record_key_t hdr;
+    u_int32_t name_len_and_hash;
+    u_int8_t name[0];
+} __attribute__((packed));
+
+#define APFS_DREC_LEN_MASK      0x000003ff
+#define APFS_DREC_HASH_MASK     0xfffffc00
+#define APFS_DREC_HASH_SHIFT    10
+
 struct apfs_record_drec_val_t {
     u_int64_t file_id;
     u_int64_t date_added;
@@ -202,6 +226,32 @@ struct apfs_record_inode_val_t {
     u_int8_t xfields[];
 } __attribute__((packed));
 
+/* APFS_TYPE_SNAP_METADATA */
+struct apfs_record_snap_metadata_val_t {
+    oid_t extentref_tree_oid;
+    oid_t sblock_oid;               /* Physical address of the volume superblock */
+    u_int64_t create_time;
+    u_int64_t change_time;
+    u_int64_t inum;
+    u_int32_t extentref_tree_type;
+    u_int32_t flags;
+    u_int16_t name_len;
+    u_int8_t name[0];
+} __attribute__((packed));
+
+/* APFS_TYPE_SNAP_NAME */
+#define APFS_SNAP_NAME_OBJ_ID   APFS_OBJ_ID_MASK
+
+struct apfs_record_snap_name_key_t {
+    struct apfs_record_key_t hdr;
+    u_int16_t name_len;
+    u_int8_t name[0];
+} __attribute__((packed));
+
+struct apfs_record_snap_name_val_t {
+    xid_t snap_xid;
+} __attribute__((packed));
+
 /* APFS_TYPE_FILE_EXTENT */
 #define APFS_RECORD_FILE_EXTENT_LEN_MASK        0x00ffffffffffffffULL
 #define APFS_RECORD_FILE_EXTENT_FLAG_MASK       0xff00000000000000ULL
@@ -218,6 +268,27 @@ struct apfs_record_file_extent_key_t {
     u_int64_t logical_addr;
 } __attribute__((packed));
 
+/* APFS_TYPE_XATTR */
+#define APFS_XATTR_DATA_STREAM          0x0001
+#define APFS_XATTR_DATA_EMBEDDED        0x0002
+#define APFS_XATTR_FILE_SYSTEM_OWNED    0x0004
+
+#define APFS_XATTR_MAX_EMBEDDED_SIZE    3804
+
+#define APFS_XATTR_SYMLINK_EA_NAME      "com.apple.fs.symlink"
+
+struct apfs_record_xattr_key_t {
+    struct apfs_record_key_t hdr;
+    u_int16_t name_len;
+    u_int8_t name[0];
+} __attribute__((packed));
+
+struct apfs_record_xattr_val_t {
+    u_int16_t flags;
+    u_int16_t xdata_len;
+    u_int8_t xdata[0];
+} __attribute__((packed));
+
 /*
  * Extended Fields
  */
@@ -243,4 +314,13 @@ struct apfs_dstream_t {
         u_int64_t total_bytes_read;
 } __attribute__((aligned(8),packed));
 
+/*
+ * Value of a xattr record with the APFS_XATTR_DATA_STREAM flag. The data
+ * is stored in the extents of the object xattr_obj_id.
+ */
+struct apfs_xattr_dstream_t {
+    u_int64_t xattr_obj_id;
+    struct apfs_dstream_t dstream;
+} __attribute__((packed));
+
 #endif /* _APFS_VOLUME_H */
@@ -0,0 +1,691 @@
+/*
+ * This file is part of the APFS-Module.
+ * Copyright (c) 2019 Jordi Barcons.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/log2.h>
+#include <linux/sched/signal.h>
+
+#include "apfs.h"
+#include "apfs/btree.h"
+#include "apfs/volume.h"
+#include "apfs/omap.h"
+
+/*
+ * Returns a pointer to the key in the position 'pos' of the node.
+ */
+static void* node_key(struct apfs_node* node, int pos, int* len)
+{
+    struct apfs_kvloc_t* kvloc;
+    struct apfs_kvoff_t* kvoff;
+
+    if (node->btn_flags & APFS_BTNODE_FIXED_KV_SIZE) {
+        kvoff = (struct apfs_kvoff_t*) node->toc + pos;
+        *len = sizeof(struct apfs_omap_key_t);
+        return node->keys + le16_to_cpu(kvoff->k);
+    }
+
+    kvloc = (struct apfs_kvloc_t*) node->toc + pos;
+    *len = le16_to_cpu(kvloc->k.len);
+    return node->keys + le16_to_cpu(kvloc->k.off);
+}
+
+/*
+ * Returns a pointer to the value in the position 'pos' of the node.
+ */
+static void* node_val(struct apfs_node* node, int pos, int* len)
+{
+    struct apfs_kvloc_t* kvloc;
+    struct apfs_kvoff_t* kvoff;
+
+    if (node->btn_flags & APFS_BTNODE_FIXED_KV_SIZE) {
+        kvoff = (struct apfs_kvoff_t*) node->toc + pos;
+        *len = node->level ? sizeof(oid_t) : sizeof(struct apfs_omap_val_t);
+        return node->vals - le16_to_cpu(kvoff->v);
+    }
+
+    kvloc = (struct apfs_kvloc_t*) node->toc + pos;
+    *len = le16_to_cpu(kvloc->v.len);
+    return node->vals - le16_to_cpu(kvloc->v.off);
+}
+
+/*
+ * Compare the key in the position 'pos' with the key (oid, type, sub).
+ * 'sub' is the logical address for the APFS_TYPE_FILE_EXTENT records. The
+ * rest of records with a name (directory entries, xattrs...) are always
+ * greater than the searched key, so a seek ends just before the first of
+ * them. Returns a negative value if the key in the node is smaller.
+ */
+static int cmp_node_key(struct apfs_node* node, int pos, u_int64_t oid,
+        u_int8_t type, u_int64_t sub)
+{
+    struct apfs_record_file_extent_key_t* ext_key;
+    struct apfs_record_key_t* hdr;
+    u_int64_t k_oid, k_sub;
+    u_int8_t k_type;
+    int len;
+
+    hdr = (struct apfs_record_key_t*) node_key(node, pos, &len);
+    k_oid = le64_to_cpu(hdr->obj_id_and_type) & APFS_OBJ_ID_MASK;
+    k_type = (le64_to_cpu(hdr->obj_id_and_type) & APFS_OBJ_TYPE_MASK)
+        >> APFS_OBJ_TYPE_SHIFT;
+
+    if (k_oid != oid)
+        return k_oid < oid ? -1 : 1;
+    if (k_type != type)
+        return k_type < type ? -1 : 1;
+
+    if (len <= sizeof(*hdr))
+        return 0;
+
+    /*
+     * The directory records are sorted by name_len_and_hash. A key with
+     * the same value is considered greater, so the seeks stop before the
+     * first record with the hash.
+     */
+    if (type == APFS_TYPE_DIR_REC) {
+        k_sub = le32_to_cpu(((struct apfs_record_drec_hashed_key_t*)
+                    hdr)->name_len_and_hash);
+        return k_sub < sub ? -1 : 1;
+    }
+
+    if (type != APFS_TYPE_FILE_EXTENT)
+        return 1;
+
+    ext_key = (struct apfs_record_file_extent_key_t*) hdr;
+    k_sub = le64_to_cpu(ext_key->logical_addr);
+    if (k_sub != sub)
+        return k_sub < sub ? -1 : 1;
+
+    return 0;
+}
+
+/*
+ * Binary search of the last key smaller or equal than the searched key.
+ * Returns -1 if all the keys of the node are greater.
+ */
+static int search_node(struct apfs_node* node, u_int64_t oid, u_int8_t type,
+        u_int64_t sub, int* exact)
+{
+    int left, right, mid, found;
+    int cmp;
+
+    left = 0;
+    right = node->nkeys - 1;
+    found = -1;
+    *exact = 0;
+
+    while (left <= right) {
+        mid = left + (right - left) / 2;
+        cmp = cmp_node_key(node, mid, oid, type, sub);
+        if (cmp <= 0) {
+            found = mid;
+            if (cmp == 0) {
+                *exact = 1;
+                break;
+            }
+            left = mid + 1;
+        } else {
+            right = mid - 1;
+        }
+    }
+
+    return found;
+}
+
+/*
+ * Returns the physical address of the child in the position 'pos' of a
+ * non-leaf node. The file-system trees store virtual object ids, so they
+ * are translated with the omap.
+ */
+static paddr_t child_paddr(struct apfs_btree_cursor* cur,
+        struct apfs_node* node, int pos)
+{
+    u_int64_t* val;
+    int len;
+
+    val = (u_int64_t*) node_val(node, pos, &len);
+    if (!cur->omap)
+        return le64_to_cpu(*val);
+
+    return get_phys_block(cur->sb, cur->omap, le64_to_cpu(*val), cur->xid);
+}
+
+/*
+ * Like child_paddr(), without adding the omap nodes and the translation to
+ * the caches.
+ */
+static paddr_t child_paddr_uncached(struct apfs_btree_cursor* cur,
+        struct apfs_node* node, int pos)
+{
+    u_int64_t* val;
+    int len;
+
+    val = (u_int64_t*) node_val(node, pos, &len);
+    if (!cur->omap)
+        return le64_to_cpu(*val);
+
+    return get_phys_block_uncached(cur->sb, cur->omap, le64_to_cpu(*val),
+            cur->xid);
+}
+
+/*
+ * Load the node 'paddr' in the level 'l' of the cursor. If the cursor
+ * already has this node, it's reused.
+ */
+static int load_level(struct apfs_btree_cursor* cur, int l, paddr_t paddr)
+{
+    struct apfs_node* node;
+
+    if (cur->nodes[l] && cur->nodes[l]->paddr == paddr)
+        return 0;
+
+    node = apfs_node_get(cur->sb, paddr);
+    if (!node)
+        return -EIO;
+
+    if (l > 0 && node->level + 1 != cur->nodes[l - 1]->level) {
+        printk(KERN_ERR "apfs: invalid level in node [%llu]\n", paddr);
+        apfs_node_put(node);
+        return -EIO;
+    }
+
+    apfs_node_put(cur->nodes[l]);
+    cur->nodes[l] = node;
+    return 0;
+}
+
+/*
+ * Go down from the level 'l' to the leaf, following the current position
+ * of each level. The new levels start in the first key (or the last if
+ * 'last' is set).
+ */
+static int descend(struct apfs_btree_cursor* cur, int l, int last)
+{
+    paddr_t paddr;
+    int err;
+
+    for (; l < cur->depth - 1; l++) {
+        paddr = child_paddr(cur, cur->nodes[l], cur->index[l]);
+        if (!paddr)
+            return -EIO;
+        err = load_level(cur, l + 1, paddr);
+        if (err)
+            return err;
+        cur->index[l + 1] = last ? cur->nodes[l + 1]->nkeys - 1 : 0;
+    }
+
+    return 0;
+}
+
+void apfs_btree_cursor_init(struct apfs_btree_cursor* cur,
+        struct super_block* sb, paddr_t root, paddr_t omap, xid_t xid)
+{
+    memset(cur, 0, sizeof(*cur));
+    cur->sb = sb;
+    cur->root = root;
+    cur->omap = omap;
+    cur->xid = xid;
+}
+
+/*
+ * Initialize a cursor for the file-system tree of the mounted volume.
+ */
+void apfs_fstree_cursor_init(struct apfs_btree_cursor* cur,
+        struct super_block* sb)
+{
+    struct apfs_glb_info* glb_info;
+
+    glb_info = (struct apfs_glb_info*) sb->s_fs_info;
+    apfs_btree_cursor_init(cur, sb, glb_info->vol_root_tree,
+            glb_info->vol_omap_tree, glb_info->vol_xid);
+}
+
+/*
+ * Use and update 'hint' in the seeks of the cursor.
+ */
+void apfs_btree_cursor_hint(struct apfs_btree_cursor* cur,
+        struct apfs_btree_hint* hint)
+{
+    cur->hint = hint;
+}
+
+void apfs_btree_cursor_release(struct apfs_btree_cursor* cur)
+{
+    int l;
+
+    for (l = 0; l < APFS_BTREE_MAX_DEPTH; l++) {
+        apfs_node_put(cur->nodes[l]);
+        cur->nodes[l] = NULL;
+    }
+    cur->depth = 0;
+    cur->hinted = false;
+}
+
+/*
+ * Seek from the root of the tree, loading all the levels of the path.
+ */
+static int seek_from_root(struct apfs_btree_cursor* cur, u_int64_t oid,
+        u_int8_t type, u_int64_t sub)
+{
+    struct apfs_node* node;
+    paddr_t paddr;
+    int l, idx, exact, err;
+
+    err = load_level(cur, 0, cur->root);
+    if (err)
+        return err;
+    cur->depth = cur->nodes[0]->level + 1;
+
+    for (l = 0; ; l++) {
+        node = cur->nodes[l];
+        idx = search_node(node, oid, type, sub, &exact);
+
+        if (node->level == 0) {
+            cur->index[l] = idx;
+            return exact ? 0 : 1;
+        }
+
+        /*
+         * All the keys are greater: the searched key would be before the
+         * first key of the leftmost leaf.
+         */
+        cur->index[l] = idx < 0 ? 0 : idx;
+
+        paddr = child_paddr(cur, node, cur->index[l]);
+        if (!paddr)
+            return -EIO;
+        err = load_level(cur, l + 1, paddr);
+        if (err)
+            return err;
+    }
+}
+
+/*
+ * Try to seek in the leaf of the hint of the cursor. The leaf is used only
+ * if its first key is smaller or equal than the searched key and its last
+ * key is greater or equal, so the result is the same as a seek from the
+ * root. Returns -EAGAIN if the hint can't be used.
+ */
+static int seek_in_hint(struct apfs_btree_cursor* cur, u_int64_t oid,
+        u_int8_t type, u_int64_t sub)
+{
+    struct apfs_node* node;
+    paddr_t paddr;
+    int idx, exact;
+
+    paddr = READ_ONCE(cur->hint->paddr);
+    if (!paddr || READ_ONCE(cur->hint->xid) != cur->xid)
+        return -EAGAIN;
+
+    node = apfs_node_get(cur->sb, paddr);
+    if (!node)
+        return -EAGAIN;
+
+    if (node->level != 0 || node->nkeys == 0
+            || cmp_node_key(node, 0, oid, type, sub) > 0
+            || cmp_node_key(node, node->nkeys - 1, oid, type, sub) < 0) {
+        apfs_node_put(node);
+        return -EAGAIN;
+    }
+
+    apfs_btree_cursor_release(cur);
+    cur->nodes[0] = node;
+    cur->depth = 1;
+    cur->hinted = true;
+    idx = search_node(node, oid, type, sub, &exact);
+    cur->index[0] = idx;
+
+    return exact ? 0 : 1;
+}
+
+/*
+ * Load the path from the root to the leaf of a cursor positioned with a
+ * hint, so it can leave the leaf. The position in the leaf is kept.
+ */
+static int load_hinted_path(struct apfs_btree_cursor* cur)
+{
+    paddr_t paddr;
+    int idx, err;
+
+    paddr = cur->nodes[0]->paddr;
+    idx = cur->index[0];
+
+    err = seek_from_root(cur, cur->seek_oid, cur->seek_type, cur->seek_sub);
+    if (err < 0)
+        return err;
+    cur->hinted = false;
+
+    if (cur->nodes[cur->depth - 1]->paddr != paddr) {
+        printk(KERN_ERR "apfs: inconsistent path to node [%llu]\n", paddr);
+        return -EIO;
+    }
+    cur->index[cur->depth - 1] = idx;
+
+    return 0;
+}
+
+/*
+ * Move the cursor to the last key smaller or equal than (oid, type, sub).
+ * Returns 0 if the key was found, 1 if the cursor is in a smaller key (the
+ * position in the leaf is -1 if all the keys are greater) or a negative
+ * error. If the cursor has a hint, its leaf is tried first and the hint is
+ * updated with the leaf found.
+ */
+int apfs_btree_seek(struct apfs_btree_cursor* cur, u_int64_t oid,
+        u_int8_t type, u_int64_t sub)
+{
+    struct apfs_node* leaf;
+    int ret;
+
+    cur->seek_oid = oid;
+    cur->seek_type = type;
+    cur->seek_sub = sub;
+
+    if (!cur->hint)
+        return seek_from_root(cur, oid, type, sub);
+
+    ret = seek_in_hint(cur, oid, type, sub);
+    if (ret != -EAGAIN)
+        return ret;
+
+    if (cur->hinted)
+        apfs_btree_cursor_release(cur);
+    ret = seek_from_root(cur, oid, type, sub);
+    if (ret < 0)
+        return ret;
+
+    leaf = cur->nodes[cur->depth - 1];
+    if (cur->index[cur->depth - 1] >= 0
+            && READ_ONCE(cur->hint->paddr) != leaf->paddr) {
+        WRITE_ONCE(cur->hint->paddr, leaf->paddr);
+        WRITE_ONCE(cur->hint->xid, cur->xid);
+    }
+
+    return ret;
+}
+
+/*
+ * Move the cursor to the first key greater or equal than (oid, type, sub).
+ * Returns 1 if the cursor is in a valid key, 0 if there are no more keys or
+ * a negative error.
+ */
+int apfs_btree_seek_ge(struct apfs_btree_cursor* cur, u_int64_t oid,
+        u_int8_t type, u_int64_t sub)
+{
+    int ret;
+
+    ret = apfs_btree_seek(cur, oid, type, sub);
+    if (ret < 0)
+        return ret;
+    if (ret == 0)
+        return 1;
+
+    return apfs_btree_next(cur);
+}
+
+/*
+ * Move the cursor to the next key. Returns 1 if the cursor is in a valid
+ * key, 0 if there are no more keys or a negative error.
+ */
+int apfs_btree_next(struct apfs_btree_cursor* cur)
+{
+    int l;
+
+    l = cur->depth - 1;
+    if (++cur->index[l] < cur->nodes[l]->nkeys)
+        return 1;
+
+    if (cur->hinted) {
+        if (load_hinted_path(cur))
+            return -EIO;
+        l = cur->depth - 1;
+    }
+
+    /*
+     * The leaf is finished. Go up until a level has more keys.
+     */
+    do {
+        if (l == 0)
+            return 0;
+        l--;
+    } while (++cur->index[l] >= cur->nodes[l]->nkeys);
+
+    return descend(cur, l, 0) ? -EIO : 1;
+}
+
+/*
+ * Move the cursor to the previous key. Returns 1 if the cursor is in a
+ * valid key, 0 if there are no more keys or a negative error.
+ */
+int apfs_btree_prev(struct apfs_btree_cursor* cur)
+{
+    int l;
+
+    l = cur->depth - 1;
+    if (--cur->index[l] >= 0)
+        return 1;
+
+    if (cur->hinted) {
+        if (load_hinted_path(cur))
+            return -EIO;
+        l = cur->depth - 1;
+    }
+
+    do {
+        if (l == 0)
+            return 0;
+        l--;
+    } while (--cur->index[l] < 0);
+
+    return descend(cur, l, 1) ? -EIO : 1;
+}
+
+/*
+ * Returns 1 if the current key of the cursor belongs to the range being
+ * scanned, 0 if it's beyond the end of the range.
+ */
+static int in_range(struct apfs_btree_cursor* cur)
+{
+    u_int64_t oid;
+    u_int8_t type;
+
+    apfs_btree_key_id(cur, &oid, &type);
+    return oid == cur->range_oid && type == cur->range_type;
+}
+
+/*
+ * Start a scan of the records (oid, type) from the first key greater or
+ * equal than (oid, type, sub), so a scan can be resumed where it was left.
+ * Returns 1 if the cursor is in a record of the range, 0 if there are no
+ * more records or a negative error.
+ */
+int apfs_btree_range_from(struct apfs_btree_cursor* cur, u_int64_t oid,
+        u_int8_t type, u_int64_t sub)
+{
+    int ret;
+
+    cur->range_oid = oid;
+    cur->range_type = type;
+
+    ret = apfs_btree_seek_ge(cur, oid, type, sub);
+    if (ret <= 0)
+        return ret;
+
+    return in_range(cur);
+}
+
+/*
+ * Start a scan of the records (oid, type). The cursor is moved to the first
+ * key greater or equal than (oid, type), so only the leaves holding these
+ * records are read. Returns 1 if the cursor is in a record of the range, 0
+ * if there are no records or a negative error.
+ */
+int apfs_btree_range_first(struct apfs_btree_cursor* cur, u_int64_t oid,
+        u_int8_t type)
+{
+    return apfs_btree_range_from(cur, oid, type, 0);
+}
+
+/*
+ * Move the cursor to the next record of the range. The scan goes across
+ * the leaf boundaries and stops in the first key beyond (oid, type).
+ * Returns 1 if the cursor is in a record of the range, 0 if the range is
+ * finished or a negative error.
+ */
+int apfs_btree_range_next(struct apfs_btree_cursor* cur)
+{
+    int ret;
+
+    ret = apfs_btree_next(cur);
+    if (ret <= 0)
+        return ret;
+
+    return in_range(cur);
+}
+
+/*
+ * Returns the key of the current position of the cursor.
+ */
+void* apfs_btree_key(struct apfs_btree_cursor* cur, int* len)
+{
+    return node_key(cur->nodes[cur->depth - 1], cur->index[cur->depth - 1],
+            len);
+}
+
+/*
+ * Returns the value of the current position of the cursor.
+ */
+void* apfs_btree_val(struct apfs_btree_cursor* cur, int* len)
+{
+    return node_val(cur->nodes[cur->depth - 1], cur->index[cur->depth - 1],
+            len);
+}
+
+/*
+ * Returns the object id and the type of the current file-system record.
+ */
+void apfs_btree_key_id(struct apfs_btree_cursor* cur, u_int64_t* oid,
+        u_int8_t* type)
+{
+    struct apfs_record_key_t* hdr;
+    int len;
+
+    hdr = (struct apfs_record_key_t*) apfs_btree_key(cur, &len);
+    *oid = le64_to_cpu(hdr->obj_id_and_type) & APFS_OBJ_ID_MASK;
+    *type = (le64_to_cpu(hdr->obj_id_and_type) & APFS_OBJ_TYPE_MASK)
+        >> APFS_OBJ_TYPE_SHIFT;
+}
+
+static int size_bucket(int len)
+{
+    if (len <= 1)
+        return 0;
+    return min_t(int, ilog2(len), APFS_STATS_SIZE_BUCKETS - 1);
+}
+
+/*
+ * Count a node of the tree in 'stats'.
+ */
+static void count_node(struct super_block* sb, struct apfs_node* node,
+        struct apfs_btree_stats* stats)
+{
+    struct apfs_btree_level_stats* level;
+    struct apfs_btree_node_phys_t* phys;
+    int c, len;
+
+    phys = node->phys;
+    level = &stats->levels[node->level];
+    level->nodes++;
+    level->keys += node->nkeys;
+    level->used += sb->s_blocksize - le16_to_cpu(phys->btn_free_space.len)
+        - le16_to_cpu(phys->btn_key_free_list.len)
+        - le16_to_cpu(phys->btn_val_free_list.len);
+
+    if (node->level)
+        return;
+
+    for (c = 0; c < node->nkeys; c++) {
+        node_key(node, c, &len);
+        stats->key_sizes[size_bucket(len)]++;
+        node_val(node, c, &len);
+        stats->val_sizes[size_bucket(len)]++;
+    }
+}
+
+/*
+ * Walk all the nodes of the tree of the cursor, depth first, and fill
+ * 'stats' with its shape. Neither the nodes of the tree nor the omap nodes
+ * and translations used to find them are added to the caches, so the walk
+ * doesn't evict the entries in use.
+ */
+int apfs_btree_stats(struct apfs_btree_cursor* cur,
+        struct apfs_btree_stats* stats)
+{
+    struct apfs_node* node;
+    paddr_t paddr;
+    int l;
+
+    memset(stats, 0, sizeof(*stats));
+    apfs_btree_cursor_release(cur);
+
+    node = apfs_node_get_uncached(cur->sb, cur->root);
+    if (!node)
+        return -EIO;
+    cur->nodes[0] = node;
+    cur->index[0] = 0;
+    cur->depth = node->level + 1;
+    stats->depth = cur->depth;
+    if (node->btn_flags & APFS_BTNODE_ROOT)
+        memcpy(&stats->info, node->buf->data + cur->sb->s_blocksize
+                - sizeof(stats->info), sizeof(stats->info));
+    count_node(cur->sb, node, stats);
+
+    l = 0;
+    while (l >= 0) {
+        node = cur->nodes[l];
+        if (node->level == 0 || cur->index[l] >= node->nkeys) {
+            if (--l >= 0)
+                cur->index[l]++;
+            continue;
+        }
+
+        if (fatal_signal_pending(current))
+            return -EINTR;
+        cond_resched();
+
+        paddr = child_paddr_uncached(cur, node, cur->index[l]);
+        if (!paddr)
+            return -EIO;
+        node = apfs_node_get_uncached(cur->sb, paddr);
+        if (!node)
+            return -EIO;
+        if (node->level + 1 != cur->nodes[l]->level) {
+            printk(KERN_ERR "apfs: invalid level in node [%llu]\n", paddr);
+            apfs_node_put(node);
+            return -EIO;
+        }
+
+        l++;
+        apfs_node_put(cur->nodes[l]);
+        cur->nodes[l] = node;
+        cur->index[l] = 0;
+        count_node(cur->sb, node, stats);
+    }
+
+    return 0;
+}
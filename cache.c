@@ -0,0 +1,539 @@
+/*
+ * This file is part of the APFS-Module.
+ * Copyright (c) 2019 Jordi Barcons.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/rculist.h>
+#include <linux/spinlock.h>
+#include <linux/percpu.h>
+
+#include "apfs.h"
+#include "apfs/btree.h"
+
+/*
+ * All the versions of an object are in the same bucket.
+ */
+static inline struct hlist_head* omap_bucket(struct apfs_omap_cache* cache,
+        paddr_t tree, oid_t oid)
+{
+    return &cache->buckets[hash_64(oid ^ rol64(tree, 17),
+            APFS_OMAP_CACHE_BITS)];
+}
+
+void apfs_omap_cache_init(struct apfs_omap_cache* cache, unsigned long max)
+{
+    int c;
+
+    spin_lock_init(&cache->lock);
+    cache->count = 0;
+    cache->max = max;
+    INIT_LIST_HEAD(&cache->lru);
+    for (c = 0; c < (1 << APFS_OMAP_CACHE_BITS); c++)
+        INIT_HLIST_HEAD(&cache->buckets[c]);
+}
+
+/*
+ * Free all the entries. Nobody can be using the cache at this point.
+ */
+void apfs_omap_cache_destroy(struct apfs_omap_cache* cache)
+{
+    struct apfs_omap_entry* entry;
+    struct hlist_node* tmp;
+    int c;
+
+    for (c = 0; c < (1 << APFS_OMAP_CACHE_BITS); c++) {
+        hlist_for_each_entry_safe(entry, tmp, &cache->buckets[c], hash) {
+            hlist_del(&entry->hash);
+            kfree(entry);
+        }
+    }
+    cache->count = 0;
+}
+
+/*
+ * Returns the physical block of the version of the object seen by the
+ * transaction 'xid' or 0 if it isn't in the cache. It doesn't sleep, so it
+ * can be used in the RCU path walk.
+ */
+paddr_t apfs_omap_cache_lookup(struct apfs_omap_cache* cache, paddr_t tree,
+        oid_t oid, xid_t xid)
+{
+    struct apfs_omap_entry* entry;
+    paddr_t paddr;
+
+    paddr = 0;
+
+    rcu_read_lock();
+    hlist_for_each_entry_rcu(entry, omap_bucket(cache, tree, oid), hash) {
+        if (entry->oid == oid && entry->tree == tree && entry->xid <= xid
+                && xid <= READ_ONCE(entry->max_xid)) {
+            if (!test_bit(APFS_OMAP_REFERENCED, &entry->flags))
+                set_bit(APFS_OMAP_REFERENCED, &entry->flags);
+            paddr = entry->paddr;
+            break;
+        }
+    }
+    rcu_read_unlock();
+
+    return paddr;
+}
+
+/*
+ * Walk an LRU list from its tail with the lock of the list held, giving a
+ * second chance to the entries used since the last scan. 'evict' removes
+ * the entry from the list and returns true, or returns false to keep it,
+ * and then the entry is moved to the head. Only the entries removed count
+ * against 'nr'; the walk also stops after two passes over the 'count'
+ * entries of the list, when all of them are kept. Returns the number of
+ * entries removed.
+ */
+unsigned long apfs_lru_walk(struct list_head* head, unsigned long count,
+        unsigned long nr, bool (*evict)(struct list_head* entry, void* arg),
+        void* arg)
+{
+    struct list_head* entry;
+    unsigned long freed, scanned;
+
+    freed = 0;
+    for (scanned = 0; freed < nr && scanned < 2 * count; scanned++) {
+        if (list_empty(head))
+            break;
+        entry = head->prev;
+        if (evict(entry, arg))
+            freed++;
+        else
+            list_move(entry, head);
+    }
+
+    return freed;
+}
+
+static bool omap_entry_evict(struct list_head* lru, void* arg)
+{
+    struct apfs_omap_cache* cache;
+    struct apfs_omap_entry* entry;
+
+    cache = (struct apfs_omap_cache*) arg;
+    entry = list_entry(lru, struct apfs_omap_entry, lru);
+    if (test_and_clear_bit(APFS_OMAP_REFERENCED, &entry->flags))
+        return false;
+
+    hlist_del_rcu(&entry->hash);
+    list_del(&entry->lru);
+    cache->count--;
+    kfree_rcu(entry, rcu);
+
+    return true;
+}
+
+/*
+ * Evict up to 'nr' entries from the LRU list. Returns the number of entries
+ * freed.
+ */
+static unsigned long omap_cache_evict(struct apfs_omap_cache* cache,
+        unsigned long nr)
+{
+    unsigned long freed;
+
+    spin_lock(&cache->lock);
+    freed = apfs_lru_walk(&cache->lru, cache->count, nr, omap_entry_evict,
+            cache);
+    spin_unlock(&cache->lock);
+
+    return freed;
+}
+
+/*
+ * Add the version 'xid' of an object, seen by the transactions up to
+ * 'max_xid'. If the version is already cached, its range is extended.
+ */
+void apfs_omap_cache_insert(struct apfs_omap_cache* cache, paddr_t tree,
+        oid_t oid, xid_t xid, xid_t max_xid, paddr_t paddr)
+{
+    struct apfs_omap_entry* entry;
+    struct apfs_omap_entry* cur;
+    struct hlist_head* bucket;
+    unsigned long over;
+
+    entry = kmalloc(sizeof(*entry), GFP_NOFS);
+    if (!entry)
+        return;
+
+    entry->flags = 0;
+    entry->tree = tree;
+    entry->oid = oid;
+    entry->xid = xid;
+    entry->max_xid = max_xid;
+    entry->paddr = paddr;
+
+    bucket = omap_bucket(cache, tree, oid);
+
+    spin_lock(&cache->lock);
+    hlist_for_each_entry(cur, bucket, hash) {
+        if (cur->oid == oid && cur->xid == xid && cur->tree == tree) {
+            if (max_xid > cur->max_xid)
+                WRITE_ONCE(cur->max_xid, max_xid);
+            spin_unlock(&cache->lock);
+            kfree(entry);
+            return;
+        }
+    }
+    hlist_add_head_rcu(&entry->hash, bucket);
+    list_add(&entry->lru, &cache->lru);
+    cache->count++;
+    over = cache->count > cache->max ? cache->count - cache->max : 0;
+    spin_unlock(&cache->lock);
+
+    if (over)
+        omap_cache_evict(cache, over);
+}
+
+void apfs_node_cache_init(struct apfs_node_cache* cache, unsigned long max)
+{
+    int c;
+
+    spin_lock_init(&cache->lock);
+    cache->count = 0;
+    cache->max = max;
+    INIT_LIST_HEAD(&cache->lru);
+    for (c = 0; c < (1 << APFS_NODE_CACHE_BITS); c++)
+        INIT_HLIST_HEAD(&cache->buckets[c]);
+}
+
+static void free_node_rcu(struct rcu_head* head)
+{
+    kfree(container_of(head, struct apfs_node, rcu));
+}
+
+/*
+ * Release a reference of the node. The node is freed when the last
+ * reference is released; at this point, it's not in the cache.
+ */
+void apfs_node_put(struct apfs_node* node)
+{
+    if (!node)
+        return;
+
+    if (refcount_dec_and_test(&node->refcnt)) {
+        apfs_release_block(node->buf);
+        call_rcu(&node->rcu, free_node_rcu);
+    }
+}
+
+struct node_evict_ctx {
+    struct apfs_node_cache* cache;
+    struct list_head dispose;
+};
+
+/*
+ * The nodes used by a cursor are kept, as evicting them wouldn't release
+ * any memory until the cursor is done with them.
+ */
+static bool node_evict(struct list_head* lru, void* arg)
+{
+    struct node_evict_ctx* ctx;
+    struct apfs_node* node;
+
+    ctx = (struct node_evict_ctx*) arg;
+    node = list_entry(lru, struct apfs_node, lru);
+    if (test_and_clear_bit(APFS_NODE_REFERENCED, &node->flags)
+            || refcount_read(&node->refcnt) > 1)
+        return false;
+
+    hlist_del_rcu(&node->hash);
+    list_move(&node->lru, &ctx->dispose);
+    ctx->cache->count--;
+
+    return true;
+}
+
+/*
+ * Evict up to 'nr' nodes from the LRU list. Returns the number of nodes
+ * freed.
+ */
+static unsigned long node_cache_evict(struct apfs_node_cache* cache,
+        unsigned long nr)
+{
+    struct node_evict_ctx ctx;
+    struct apfs_node* node;
+    struct apfs_node* tmp;
+    unsigned long freed;
+
+    ctx.cache = cache;
+    INIT_LIST_HEAD(&ctx.dispose);
+
+    spin_lock(&cache->lock);
+    freed = apfs_lru_walk(&cache->lru, cache->count, nr, node_evict, &ctx);
+    spin_unlock(&cache->lock);
+
+    list_for_each_entry_safe(node, tmp, &ctx.dispose, lru) {
+        list_del_init(&node->lru);
+        apfs_node_put(node);
+    }
+
+    return freed;
+}
+
+/*
+ * Free all the nodes. Nobody can be using the cache at this point.
+ */
+void apfs_node_cache_destroy(struct apfs_node_cache* cache)
+{
+    struct apfs_node* node;
+    struct apfs_node* tmp;
+
+    list_for_each_entry_safe(node, tmp, &cache->lru, lru) {
+        hlist_del(&node->hash);
+        list_del_init(&node->lru);
+        apfs_node_put(node);
+    }
+    cache->count = 0;
+}
+
+/*
+ * Read a node from the disk and decode its zones.
+ */
+static struct apfs_node* read_node(struct super_block* sb, paddr_t paddr)
+{
+    struct apfs_node* node;
+    struct apfs_btree_node_phys_t* phys;
+    u_int32_t toc_end;
+
+    node = kzalloc(sizeof(*node), GFP_NOFS);
+    if (!node) {
+        printk(KERN_ERR "apfs: not enought memory\n");
+        return NULL;
+    }
+
+    node->buf = apfs_read_block(sb, paddr);
+    if (!node->buf) {
+        kfree(node);
+        return NULL;
+    }
+
+    phys = (struct apfs_btree_node_phys_t*) node->buf->data;
+    toc_end = sizeof(*phys) + le16_to_cpu(phys->btn_table_space.off)
+        + le16_to_cpu(phys->btn_table_space.len);
+    if (toc_end > sb->s_blocksize
+            || le16_to_cpu(phys->btn_level) >= APFS_BTREE_MAX_DEPTH) {
+        printk(KERN_ERR "apfs: invalid B-Tree node [%llu]\n", paddr);
+        apfs_release_block(node->buf);
+        kfree(node);
+        return NULL;
+    }
+
+    node->paddr = paddr;
+    node->phys = phys;
+    node->nkeys = le32_to_cpu(phys->btn_nkeys);
+    node->level = le16_to_cpu(phys->btn_level);
+    node->btn_flags = le16_to_cpu(phys->btn_flags);
+    node->toc = get_toc_zone(phys);
+    node->keys = get_key_zone(phys);
+    node->vals = get_val_zone(sb, phys);
+    refcount_set(&node->refcnt, 1);
+    INIT_LIST_HEAD(&node->lru);
+
+    return node;
+}
+
+/*
+ * Count a sampled access to the node cache in the heat of the level of the
+ * node.
+ */
+static void count_heat(struct apfs_glb_info* glb_info, struct apfs_node* node,
+        bool hit)
+{
+    struct apfs_node_heat* heat;
+
+    if (!glb_info->heat)
+        return;
+
+    heat = get_cpu_ptr(glb_info->heat);
+    if (++heat->tick % APFS_HEAT_SAMPLE == 0) {
+        if (hit)
+            heat->hits[node->level]++;
+        else
+            heat->reads[node->level]++;
+    }
+    put_cpu_ptr(glb_info->heat);
+}
+
+/*
+ * Look for the node 'paddr' in the cache. Returns it with a new reference,
+ * or NULL if it's not cached.
+ */
+static struct apfs_node* node_cache_lookup(struct apfs_node_cache* cache,
+        paddr_t paddr)
+{
+    struct apfs_node* node;
+    struct hlist_head* bucket;
+
+    bucket = &cache->buckets[hash_64(paddr, APFS_NODE_CACHE_BITS)];
+
+    rcu_read_lock();
+    hlist_for_each_entry_rcu(node, bucket, hash) {
+        if (node->paddr == paddr && refcount_inc_not_zero(&node->refcnt)) {
+            if (!test_bit(APFS_NODE_REFERENCED, &node->flags))
+                set_bit(APFS_NODE_REFERENCED, &node->flags);
+            rcu_read_unlock();
+            return node;
+        }
+    }
+    rcu_read_unlock();
+
+    return NULL;
+}
+
+/*
+ * Returns the node at the physical address 'paddr'. The node is found in
+ * the cache or read from the disk and added to the cache. The caller must
+ * release it with apfs_node_put().
+ */
+struct apfs_node* apfs_node_get(struct super_block* sb, paddr_t paddr)
+{
+    struct apfs_glb_info* glb_info;
+    struct apfs_node_cache* cache;
+    struct apfs_node* node;
+    struct apfs_node* cur;
+    struct hlist_head* bucket;
+    unsigned long over;
+
+    glb_info = (struct apfs_glb_info*) sb->s_fs_info;
+    cache = &glb_info->node_cache;
+    bucket = &cache->buckets[hash_64(paddr, APFS_NODE_CACHE_BITS)];
+
+    node = node_cache_lookup(cache, paddr);
+    if (node) {
+        count_heat(glb_info, node, true);
+        return node;
+    }
+
+    node = read_node(sb, paddr);
+    if (!node)
+        return NULL;
+    count_heat(glb_info, node, false);
+
+    /*
+     * Other thread could have added the same node in the meantime.
+     */
+    spin_lock(&cache->lock);
+    hlist_for_each_entry(cur, bucket, hash) {
+        if (cur->paddr == paddr && refcount_inc_not_zero(&cur->refcnt)) {
+            spin_unlock(&cache->lock);
+            apfs_node_put(node);
+            return cur;
+        }
+    }
+    refcount_inc(&node->refcnt);
+    hlist_add_head_rcu(&node->hash, bucket);
+    list_add(&node->lru, &cache->lru);
+    cache->count++;
+    over = cache->count > cache->max ? cache->count - cache->max : 0;
+    spin_unlock(&cache->lock);
+
+    if (over)
+        node_cache_evict(cache, over);
+
+    return node;
+}
+
+/*
+ * Like apfs_node_get(), but a node read from the disk is not added to the
+ * cache and it's freed by its last apfs_node_put(). Used by the walks of
+ * whole trees, that would evict all the cached nodes.
+ */
+struct apfs_node* apfs_node_get_uncached(struct super_block* sb,
+        paddr_t paddr)
+{
+    struct apfs_glb_info* glb_info;
+    struct apfs_node* node;
+
+    glb_info = (struct apfs_glb_info*) sb->s_fs_info;
+    node = node_cache_lookup(&glb_info->node_cache, paddr);
+    if (node)
+        return node;
+
+    return read_node(sb, paddr);
+}
+
+void apfs_inode_lru_init(struct apfs_inode_lru* lru, unsigned long max)
+{
+    spin_lock_init(&lru->lock);
+    lru->count = 0;
+    lru->max = max;
+    INIT_LIST_HEAD(&lru->list);
+}
+
+static unsigned long apfs_cache_count(struct shrinker* shrink,
+        struct shrink_control* sc)
+{
+    struct apfs_glb_info* glb_info;
+
+    glb_info = container_of(shrink, struct apfs_glb_info, shrinker);
+
+    return READ_ONCE(glb_info->node_cache.count)
+        + READ_ONCE(glb_info->xattr_lru.count)
+        + READ_ONCE(glb_info->dir_lru.count)
+        + READ_ONCE(glb_info->cnt->omap_cache.count);
+}
+
+/*
+ * Release cached objects under memory pressure. The nodes go first, as
+ * they pin a whole block each; then the xattrs and the omap translations,
+ * which are small and cheap to keep. The omap cache is shared by the
+ * volumes of the container, so each of their shrinkers can release it.
+ */
+static unsigned long apfs_cache_scan(struct shrinker* shrink,
+        struct shrink_control* sc)
+{
+    struct apfs_glb_info* glb_info;
+    unsigned long nr, freed;
+
+    glb_info = container_of(shrink, struct apfs_glb_info, shrinker);
+    nr = sc->nr_to_scan;
+
+    freed = node_cache_evict(&glb_info->node_cache, nr);
+    if (freed < nr)
+        freed += apfs_xattr_lru_shrink(&glb_info->xattr_lru, nr - freed);
+    if (freed < nr)
+        freed += apfs_dir_lru_shrink(&glb_info->dir_lru, nr - freed);
+    if (freed < nr)
+        freed += omap_cache_evict(&glb_info->cnt->omap_cache, nr - freed);
+
+    return freed;
+}
+
+/*
+ * Register the shrinker of the caches of a volume. The caches must be
+ * initialized before.
+ */
+int apfs_register_shrinker(struct apfs_glb_info* glb_info)
+{
+    glb_info->shrinker.count_objects = apfs_cache_count;
+    glb_info->shrinker.scan_objects = apfs_cache_scan;
+    glb_info->shrinker.seeks = DEFAULT_SEEKS;
+    glb_info->shrinker.batch = 0;
+    glb_info->shrinker.flags = 0;
+
+    return register_shrinker(&glb_info->shrinker);
+}
+
+void apfs_unregister_shrinker(struct apfs_glb_info* glb_info)
+{
+    unregister_shrinker(&glb_info->shrinker);
+}
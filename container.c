@@ -0,0 +1,299 @@
+/*
+ * This file is part of the APFS-Module.
+ * Copyright (c) 2019 Jordi Barcons.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/log2.h>
+
+#include "apfs.h"
+#include "apfs/container.h"
+#include "apfs/omap.h"
+
+/*
+ * Containers with mounted volumes. Every volume mounted from the same block
+ * device shares the same container.
+ */
+static LIST_HEAD(apfs_containers);
+static DEFINE_MUTEX(apfs_containers_lock);
+
+static void set_block_size(struct super_block* sb, u_int32_t block_size)
+{
+    sb->s_blocksize = block_size;
+    sb->s_blocksize_bits = ilog2(block_size);
+}
+
+/*
+ * Read the superblock of the container of 'sb' and the location of the
+ * container omap. The block size of 'sb' is set from the superblock.
+ * TODO: Read the last valid superblock. Currently, the first block is read.
+ * This is correct if the device was properly unmounted.
+ */
+static struct apfs_container* read_container(struct super_block* sb,
+        unsigned long omap_max)
+{
+    struct apfs_container* cnt;
+    struct apfs_superblock_t* apfs_cnt;
+    struct apfs_omap_phys_t* omap_obj;
+    struct apfs_buf* buf;
+    u_int32_t block_size;
+
+    buf = apfs_read_super_block(sb);
+    if (!buf) {
+        printk(KERN_ERR "apfs: unable to read the superblock\n");
+        return NULL;
+    }
+    apfs_cnt = (struct apfs_superblock_t*) buf->data;
+
+    if (le32_to_cpu(apfs_cnt->magic_number) != APFS_MAGIC) {
+        printk(KERN_ERR "apfs: it is not an APFS partition\n");
+        goto release_buf;
+    }
+
+    block_size = le32_to_cpu(apfs_cnt->block_size);
+    if (block_size < APFS_DEFAULT_BLOCK_SIZE
+            || block_size > APFS_MAXIMUM_BLOCK_SIZE
+            || !is_power_of_2(block_size)) {
+        printk(KERN_ERR "apfs: does not have a valid block size\n");
+        goto release_buf;
+    }
+
+    /*
+     * The file data is read a page at a time from a single extent, so
+     * the blocks can't be smaller than a page (e.g. 4K blocks with 64K
+     * pages).
+     */
+    if (block_size < PAGE_SIZE) {
+        printk(KERN_ERR "apfs: block size %u smaller than the page size\n",
+                block_size);
+        goto release_buf;
+    }
+
+    cnt = kzalloc(sizeof(*cnt), GFP_KERNEL);
+    if (!cnt) {
+        printk(KERN_ERR "apfs: not enought memory\n");
+        goto release_buf;
+    }
+
+    cnt->raw = kmemdup(apfs_cnt, sizeof(*apfs_cnt), GFP_KERNEL);
+    if (!cnt->raw) {
+        printk(KERN_ERR "apfs: not enought memory\n");
+        kfree(cnt);
+        goto release_buf;
+    }
+    apfs_release_block(buf);
+
+    cnt->bdev = sb->s_bdev;
+    cnt->refcnt = 1;
+    cnt->block_size = block_size;
+    cnt->oid = le64_to_cpu(cnt->raw->obj_h.oid);
+    cnt->xid = le64_to_cpu(cnt->raw->obj_h.xid);
+    apfs_omap_cache_init(&cnt->omap_cache, omap_max);
+    mutex_init(&cnt->sm_lock);
+    set_block_size(sb, block_size);
+
+    /*
+     * Look for the block number of the container omap tree.
+     */
+    buf = apfs_read_block(sb, le64_to_cpu(cnt->raw->omap_oid));
+    if (!buf)
+        goto free_raw;
+    omap_obj = (struct apfs_omap_phys_t*) buf->data;
+    cnt->omap_tree = le64_to_cpu(omap_obj->om_tree_oid);
+    apfs_release_block(buf);
+
+    return cnt;
+
+free_raw:
+    apfs_omap_cache_destroy(&cnt->omap_cache);
+    kfree(cnt->raw);
+    kfree(cnt);
+    return NULL;
+release_buf:
+    apfs_release_block(buf);
+    return NULL;
+}
+
+/*
+ * Returns the container of the block device of 'sb'. It's read from the
+ * disk only if no other volume of the container is mounted; in this case,
+ * 'omap_max' is the size limit of its omap cache. The block size of 'sb'
+ * is set from the container. Returns NULL on failure.
+ */
+struct apfs_container* apfs_get_container(struct super_block* sb,
+        unsigned long omap_max)
+{
+    struct apfs_container* cnt;
+
+    mutex_lock(&apfs_containers_lock);
+    list_for_each_entry(cnt, &apfs_containers, list) {
+        if (cnt->bdev == sb->s_bdev) {
+            cnt->refcnt++;
+            set_block_size(sb, cnt->block_size);
+            goto out;
+        }
+    }
+
+    cnt = read_container(sb, omap_max);
+    if (cnt)
+        list_add(&cnt->list, &apfs_containers);
+out:
+    mutex_unlock(&apfs_containers_lock);
+
+    return cnt;
+}
+
+/*
+ * Release a reference of the container. The last volume to be unmounted
+ * frees it.
+ */
+void apfs_put_container(struct apfs_container* cnt)
+{
+    if (!cnt)
+        return;
+
+    mutex_lock(&apfs_containers_lock);
+    if (--cnt->refcnt == 0) {
+        list_del(&cnt->list);
+        apfs_omap_cache_destroy(&cnt->omap_cache);
+        kfree(cnt->raw);
+        kfree(cnt);
+    }
+    mutex_unlock(&apfs_containers_lock);
+}
+
+/*
+ * Look for the physical address of the ephemeral object 'oid' in the
+ * checkpoint maps of the current checkpoint. Returns 0 if not found.
+ */
+static paddr_t find_ephemeral(struct super_block* sb,
+        struct apfs_container* cnt, oid_t oid)
+{
+    struct apfs_checkpoint_map_phys_t* cpm;
+    struct apfs_buf* buf;
+    u_int32_t desc_blocks;
+    u_int32_t index;
+    u_int32_t len;
+    u_int32_t count;
+    paddr_t base;
+    paddr_t paddr;
+    int c, i;
+
+    desc_blocks = le32_to_cpu(cnt->raw->xp_desc_blocks);
+    if (desc_blocks & ~APFS_XP_DESC_BLOCKS_MASK) {
+        printk(KERN_ERR "apfs: non-contiguous checkpoint areas are not "
+                "supported\n");
+        return 0;
+    }
+    base = le64_to_cpu(cnt->raw->xp_desc_base);
+    index = le32_to_cpu(cnt->raw->xp_desc_index);
+    len = le32_to_cpu(cnt->raw->xp_desc_len);
+    if (!desc_blocks || len > desc_blocks)
+        return 0;
+
+    /*
+     * The last block of the checkpoint is the copy of the superblock, the
+     * others are the checkpoint maps.
+     */
+    paddr = 0;
+    for (c = 0; c + 1 < len && !paddr; c++) {
+        buf = apfs_read_block(sb, base + (index + c) % desc_blocks);
+        if (!buf)
+            return 0;
+        cpm = (struct apfs_checkpoint_map_phys_t*) buf->data;
+
+        if (le16_to_cpu(cpm->obj_h.block_type) != APFS_OBJ_TYPE_CHECKPOINT_MAP
+                || le64_to_cpu(cpm->obj_h.xid) != cnt->xid) {
+            apfs_release_block(buf);
+            continue;
+        }
+
+        count = min_t(u_int32_t, le32_to_cpu(cpm->cpm_count),
+                (cnt->block_size - sizeof(*cpm)) / sizeof(cpm->cpm_map[0]));
+        for (i = 0; i < count; i++) {
+            if (le64_to_cpu(cpm->cpm_map[i].cpm_oid) == oid) {
+                paddr = le64_to_cpu(cpm->cpm_map[i].cpm_paddr);
+                break;
+            }
+        }
+        apfs_release_block(buf);
+    }
+
+    return paddr;
+}
+
+/*
+ * Read the free block counters of the space manager.
+ */
+static int read_spaceman(struct super_block* sb, struct apfs_container* cnt,
+        u_int64_t* free)
+{
+    struct apfs_spaceman_phys_t* sm;
+    struct apfs_buf* buf;
+    paddr_t paddr;
+    int c;
+
+    paddr = find_ephemeral(sb, cnt, le64_to_cpu(cnt->raw->spaceman_oid));
+    if (!paddr) {
+        printk(KERN_ERR "apfs: unable to find the space manager\n");
+        return -EIO;
+    }
+
+    buf = apfs_read_block(sb, paddr);
+    if (!buf)
+        return -EIO;
+    sm = (struct apfs_spaceman_phys_t*) buf->data;
+    if (le16_to_cpu(sm->obj_h.block_type) != APFS_OBJ_TYPE_SPACEMAN) {
+        printk(KERN_ERR "apfs: invalid space manager [%llu]\n", paddr);
+        apfs_release_block(buf);
+        return -EIO;
+    }
+
+    *free = 0;
+    for (c = 0; c < APFS_SD_COUNT; c++)
+        *free += le64_to_cpu(sm->sm_dev[c].sm_free_count);
+    apfs_release_block(buf);
+
+    return 0;
+}
+
+/*
+ * Returns the free blocks of the container of 'sb'. The space manager is
+ * only read once for each checkpoint; the volumes of the container share
+ * the counter.
+ */
+int apfs_container_free_blocks(struct super_block* sb, u_int64_t* free)
+{
+    struct apfs_glb_info* glb_info;
+    struct apfs_container* cnt;
+    int err;
+
+    glb_info = (struct apfs_glb_info*) sb->s_fs_info;
+    cnt = glb_info->cnt;
+
+    err = 0;
+    mutex_lock(&cnt->sm_lock);
+    if (cnt->sm_xid != cnt->xid) {
+        err = read_spaceman(sb, cnt, &cnt->sm_free);
+        if (!err)
+            cnt->sm_xid = cnt->xid;
+    }
+    *free = cnt->sm_free;
+    mutex_unlock(&cnt->sm_lock);
+
+    return err;
+}
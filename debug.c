@@ -0,0 +1,353 @@
+/*
+ * This file is part of the APFS-Module.
+ * Copyright (c) 2019 Jordi Barcons.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/kdev_t.h>
+#include <linux/math64.h>
+#include <linux/log2.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "apfs.h"
+#include "apfs/btree.h"
+
+/*
+ * Each mounted volume has a directory in <debugfs>/apfs, named after its
+ * device number, with these files:
+ *
+ *   fstree, omap   Shape of the file-system tree and of the omap tree of
+ *                  the volume. The trees are walked when the file is read.
+ *   node_heat      Sampled accesses to the B-Tree nodes by level, found in
+ *                  the node cache (hits) or read from the disk (reads).
+ *   latency        Latency percentiles and histograms of the operations.
+ *                  Writing to the file resets the histograms.
+ */
+static struct dentry* apfs_debugfs_root;
+
+static void show_sizes(struct seq_file* m, const char* name,
+        u_int64_t* sizes)
+{
+    int c;
+
+    seq_printf(m, "%s sizes:\n", name);
+    for (c = 0; c < APFS_STATS_SIZE_BUCKETS; c++) {
+        if (!sizes[c])
+            continue;
+        if (c == APFS_STATS_SIZE_BUCKETS - 1)
+            seq_printf(m, "  %5u+      %llu\n", 1 << c, sizes[c]);
+        else
+            seq_printf(m, "  %5u-%-5u %llu\n", c ? 1 << c : 0,
+                    (2 << c) - 1, sizes[c]);
+    }
+}
+
+static int show_btree(struct seq_file* m, struct super_block* sb,
+        paddr_t root, paddr_t omap, xid_t xid)
+{
+    struct apfs_btree_level_stats* level;
+    struct apfs_btree_stats* stats;
+    struct apfs_btree_cursor cur;
+    u_int64_t fanout;
+    int l, err;
+
+    stats = kmalloc(sizeof(*stats), GFP_KERNEL);
+    if (!stats)
+        return -ENOMEM;
+
+    apfs_btree_cursor_init(&cur, sb, root, omap, xid);
+    err = apfs_btree_stats(&cur, stats);
+    apfs_btree_cursor_release(&cur);
+    if (err)
+        goto out;
+
+    seq_printf(m, "depth: %d\n", stats->depth);
+    seq_printf(m, "key count: %llu\n",
+            le64_to_cpu(stats->info.bt_key_count));
+    seq_printf(m, "node count: %llu\n",
+            le64_to_cpu(stats->info.bt_node_count));
+    seq_printf(m, "longest key: %u\n",
+            le32_to_cpu(stats->info.bt_longest_key));
+    seq_printf(m, "longest value: %u\n",
+            le32_to_cpu(stats->info.bt_longest_val));
+
+    seq_puts(m, "level    nodes       keys   fanout  fill\n");
+    for (l = stats->depth - 1; l >= 0; l--) {
+        level = &stats->levels[l];
+        if (!level->nodes)
+            continue;
+        fanout = div64_u64(level->keys * 10, level->nodes);
+        seq_printf(m, "%5d %8llu %10llu %6llu.%llu  %3llu%%\n", l,
+                level->nodes, level->keys, fanout / 10, fanout % 10,
+                div64_u64(level->used * 100,
+                    level->nodes * sb->s_blocksize));
+    }
+
+    show_sizes(m, "key", stats->key_sizes);
+    show_sizes(m, "value", stats->val_sizes);
+
+out:
+    kfree(stats);
+    return err;
+}
+
+static int fstree_show(struct seq_file* m, void* v)
+{
+    struct super_block* sb;
+    struct apfs_glb_info* glb_info;
+
+    sb = (struct super_block*) m->private;
+    glb_info = (struct apfs_glb_info*) sb->s_fs_info;
+
+    return show_btree(m, sb, glb_info->vol_root_tree,
+            glb_info->vol_omap_tree, glb_info->vol_xid);
+}
+DEFINE_SHOW_ATTRIBUTE(fstree);
+
+static int omap_show(struct seq_file* m, void* v)
+{
+    struct super_block* sb;
+    struct apfs_glb_info* glb_info;
+
+    sb = (struct super_block*) m->private;
+    glb_info = (struct apfs_glb_info*) sb->s_fs_info;
+
+    return show_btree(m, sb, glb_info->vol_omap_tree, 0, 0);
+}
+DEFINE_SHOW_ATTRIBUTE(omap);
+
+static int node_heat_show(struct seq_file* m, void* v)
+{
+    struct super_block* sb;
+    struct apfs_glb_info* glb_info;
+    struct apfs_node_heat* heat;
+    unsigned long hits[APFS_BTREE_MAX_DEPTH] = { 0 };
+    unsigned long reads[APFS_BTREE_MAX_DEPTH] = { 0 };
+    int cpu, l;
+
+    sb = (struct super_block*) m->private;
+    glb_info = (struct apfs_glb_info*) sb->s_fs_info;
+    if (!glb_info->heat)
+        return -ENODEV;
+
+    for_each_possible_cpu(cpu) {
+        heat = per_cpu_ptr(glb_info->heat, cpu);
+        for (l = 0; l < APFS_BTREE_MAX_DEPTH; l++) {
+            hits[l] += READ_ONCE(heat->hits[l]);
+            reads[l] += READ_ONCE(heat->reads[l]);
+        }
+    }
+
+    seq_printf(m, "sampling: 1/%d\n", APFS_HEAT_SAMPLE);
+    seq_puts(m, "level       hits      reads\n");
+    for (l = APFS_BTREE_MAX_DEPTH - 1; l >= 0; l--) {
+        if (!hits[l] && !reads[l])
+            continue;
+        seq_printf(m, "%5d %10lu %10lu\n", l, hits[l], reads[l]);
+    }
+
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(node_heat);
+
+static const char* const apfs_lat_names[APFS_LAT_NR_OPS] = {
+    [APFS_LAT_LOOKUP] = "lookup",
+    [APFS_LAT_READDIR] = "readdir",
+    [APFS_LAT_READ] = "read",
+    [APFS_LAT_INODE] = "inode",
+    [APFS_LAT_OMAP] = "omap",
+};
+
+/*
+ * Count the latency of an operation started at 'start' (in ns, from
+ * ktime_get_ns()). The counters are per-cpu, so no lock or atomic
+ * operation is needed.
+ */
+void apfs_lat_record(struct super_block* sb, enum apfs_lat_op op,
+        u_int64_t start)
+{
+    struct apfs_glb_info* glb_info;
+    u_int64_t delta;
+    int b;
+
+    glb_info = (struct apfs_glb_info*) sb->s_fs_info;
+    if (!glb_info->latency)
+        return;
+
+    delta = ktime_get_ns() - start;
+    b = delta ? min_t(int, ilog2(delta), APFS_LAT_BUCKETS - 1) : 0;
+    this_cpu_inc(glb_info->latency->buckets[op][b]);
+}
+
+/*
+ * Returns the upper bound, in ns, of the bucket with the 'permille'
+ * percentile of the histogram.
+ */
+static u_int64_t lat_percentile(unsigned long* buckets, u_int64_t total,
+        unsigned int permille)
+{
+    u_int64_t target, sum;
+    int b;
+
+    target = div_u64(total * permille + 999, 1000);
+    sum = 0;
+    for (b = 0; b < APFS_LAT_BUCKETS; b++) {
+        sum += buckets[b];
+        if (sum >= target)
+            break;
+    }
+
+    return (2ULL << min(b, APFS_LAT_BUCKETS - 1)) - 1;
+}
+
+static int latency_show(struct seq_file* m, void* v)
+{
+    struct super_block* sb;
+    struct apfs_glb_info* glb_info;
+    struct apfs_latency* lat;
+    unsigned long buckets[APFS_LAT_BUCKETS];
+    u_int64_t total;
+    int op, cpu, b;
+
+    sb = (struct super_block*) m->private;
+    glb_info = (struct apfs_glb_info*) sb->s_fs_info;
+    if (!glb_info->latency)
+        return -ENODEV;
+
+    seq_puts(m, "op            count        p50        p90        p99"
+            "       p999 (ns)\n");
+    for (op = 0; op < APFS_LAT_NR_OPS; op++) {
+        memset(buckets, 0, sizeof(buckets));
+        for_each_possible_cpu(cpu) {
+            lat = per_cpu_ptr(glb_info->latency, cpu);
+            for (b = 0; b < APFS_LAT_BUCKETS; b++)
+                buckets[b] += READ_ONCE(lat->buckets[op][b]);
+        }
+
+        total = 0;
+        for (b = 0; b < APFS_LAT_BUCKETS; b++)
+            total += buckets[b];
+        seq_printf(m, "%-8s %10llu", apfs_lat_names[op], total);
+        if (total)
+            seq_printf(m, " %10llu %10llu %10llu %10llu",
+                    lat_percentile(buckets, total, 500),
+                    lat_percentile(buckets, total, 900),
+                    lat_percentile(buckets, total, 990),
+                    lat_percentile(buckets, total, 999));
+        seq_putc(m, '\n');
+
+        for (b = 0; b < APFS_LAT_BUCKETS; b++)
+            if (buckets[b])
+                seq_printf(m, "  %14llu+ %lu\n", b ? 1ULL << b : 0,
+                        buckets[b]);
+    }
+
+    return 0;
+}
+
+static int latency_open(struct inode* inode, struct file* file)
+{
+    return single_open(file, latency_show, inode->i_private);
+}
+
+/*
+ * Any write resets the histograms. The increments that race with the reset
+ * may be lost.
+ */
+static ssize_t latency_write(struct file* file, const char __user* buf,
+        size_t len, loff_t* ppos)
+{
+    struct super_block* sb;
+    struct apfs_glb_info* glb_info;
+    int cpu;
+
+    sb = (struct super_block*) ((struct seq_file*) file->private_data)->private;
+    glb_info = (struct apfs_glb_info*) sb->s_fs_info;
+    if (!glb_info->latency)
+        return -ENODEV;
+
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(glb_info->latency, cpu), 0,
+                sizeof(struct apfs_latency));
+
+    return len;
+}
+
+static const struct file_operations latency_fops = {
+    .owner = THIS_MODULE,
+    .open = latency_open,
+    .read = seq_read,
+    .write = latency_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/*
+ * Create the directory of a mounted volume. The errors are ignored, the
+ * volume works without it.
+ */
+void apfs_debugfs_register(struct super_block* sb)
+{
+    struct apfs_glb_info* glb_info;
+    struct dentry* dir;
+    char name[32];
+
+    glb_info = (struct apfs_glb_info*) sb->s_fs_info;
+    if (!apfs_debugfs_root)
+        return;
+
+    snprintf(name, sizeof(name), "%u:%u", MAJOR(sb->s_dev),
+            MINOR(sb->s_dev));
+    dir = debugfs_create_dir(name, apfs_debugfs_root);
+    if (IS_ERR(dir))
+        return;
+
+    debugfs_create_file("fstree", 0400, dir, sb, &fstree_fops);
+    debugfs_create_file("omap", 0400, dir, sb, &omap_fops);
+    debugfs_create_file("node_heat", 0400, dir, sb, &node_heat_fops);
+    debugfs_create_file("latency", 0600, dir, sb, &latency_fops);
+    glb_info->debugfs_dir = dir;
+}
+
+/*
+ * Remove the directory of the volume. It waits for the readers of its
+ * files, so it must be called before the volume is released.
+ */
+void apfs_debugfs_unregister(struct super_block* sb)
+{
+    struct apfs_glb_info* glb_info;
+
+    glb_info = (struct apfs_glb_info*) sb->s_fs_info;
+    debugfs_remove_recursive(glb_info->debugfs_dir);
+    glb_info->debugfs_dir = NULL;
+}
+
+void apfs_debugfs_init(void)
+{
+    struct dentry* root;
+
+    root = debugfs_create_dir("apfs", NULL);
+    apfs_debugfs_root = IS_ERR(root) ? NULL : root;
+}
+
+void apfs_debugfs_exit(void)
+{
+    debugfs_remove_recursive(apfs_debugfs_root);
+    apfs_debugfs_root = NULL;
+}
@@ -0,0 +1,260 @@
+/*
+ * This file is part of the APFS-Module.
+ * Copyright (c) 2019 Jordi Barcons.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <linux/fs.h>
+#include <linux/dcache.h>
+#include <linux/hash.h>
+#include <linux/string.h>
+#include <linux/bitops.h>
+#include <linux/unicode.h>
+#include <asm/unaligned.h>
+
+#include "apfs.h"
+
+#define APFS_ONES_WORD      0x0101010101010101ULL
+#define APFS_HIGH_BITS      0x8080808080808080ULL
+
+/*
+ * Returns a word with the next 'len' bytes of 'name' (at most 8). The
+ * remaining bytes of the word are zero.
+ */
+static inline u_int64_t load_name_word(const char* name, unsigned int len)
+{
+    u_int64_t word;
+
+    if (len >= sizeof(word))
+        return get_unaligned((u_int64_t*) name);
+
+    word = 0;
+    memcpy(&word, name, len);
+    return word;
+}
+
+/*
+ * Converts the ASCII uppercase letters of a word to lowercase. The word
+ * must not have bytes with the high bit set, so the additions never carry
+ * to the next byte.
+ */
+static inline u_int64_t fold_ascii_word(u_int64_t word)
+{
+    u_int64_t ge_a, gt_z;
+
+    ge_a = word + (0x80 - 'A') * APFS_ONES_WORD;
+    gt_z = word + (0x7f - 'Z') * APFS_ONES_WORD;
+
+    return word | ((ge_a & ~gt_z & APFS_HIGH_BITS) >> 2);
+}
+
+/*
+ * Returns true if all the characters of the name are ASCII.
+ */
+static bool is_ascii_name(const char* name, unsigned int len)
+{
+    u_int64_t acum;
+
+    acum = 0;
+    for (; len >= sizeof(acum); len -= sizeof(acum), name += sizeof(acum))
+        acum |= load_name_word(name, sizeof(acum));
+    acum |= load_name_word(name, len);
+
+    return !(acum & APFS_HIGH_BITS);
+}
+
+/*
+ * Fold a word only if all its characters are ASCII. The words that came
+ * from an utf8 casefolded name are already folded.
+ */
+static inline u_int64_t fold_name_word(u_int64_t word)
+{
+    if (word & APFS_HIGH_BITS)
+        return word;
+    return fold_ascii_word(word);
+}
+
+/*
+ * Hash a name eight bytes at a time, folding the ASCII letters.
+ */
+static u_int32_t hash_folded_name(const void* salt, const char* name,
+        unsigned int len)
+{
+    u_int64_t hash;
+    u_int64_t word;
+
+    hash = (unsigned long) salt;
+    for (; len >= sizeof(word); len -= sizeof(word), name += sizeof(word)) {
+        word = fold_name_word(load_name_word(name, sizeof(word)));
+        hash = rol64((hash ^ word) * GOLDEN_RATIO_64, 29);
+    }
+    word = fold_name_word(load_name_word(name, len));
+    hash = (hash ^ word ^ len) * GOLDEN_RATIO_64;
+
+    return (u_int32_t)(hash >> 32);
+}
+
+/*
+ * Compare two ASCII names of the same length without case.
+ */
+static int cmp_folded_names(const char* a, const char* b, unsigned int len)
+{
+    unsigned int n;
+
+    for (; len > 0; len -= n, a += n, b += n) {
+        n = min_t(unsigned int, len, sizeof(u_int64_t));
+        if (fold_ascii_word(load_name_word(a, n))
+                != fold_ascii_word(load_name_word(b, n)))
+            return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Case-insensitive comparison of two names. Returns 0 if they are equal.
+ * ASCII names are compared in place; other names are casefolded and
+ * normalized using the utf8 tables of the volume (if available).
+ */
+static int cmp_names(struct super_block* sb, const char* a, unsigned int alen,
+        const char* b, unsigned int blen)
+{
+    bool a_ascii, b_ascii;
+#if IS_ENABLED(CONFIG_UNICODE)
+    struct apfs_glb_info* glb_info;
+    const struct qstr qa = QSTR_INIT(a, alen);
+    const struct qstr qb = QSTR_INIT(b, blen);
+    int ret;
+#endif
+
+    a_ascii = is_ascii_name(a, alen);
+    b_ascii = is_ascii_name(b, blen);
+
+    if (a_ascii && b_ascii) {
+        if (alen != blen)
+            return 1;
+        return cmp_folded_names(a, b, alen);
+    }
+
+#if IS_ENABLED(CONFIG_UNICODE)
+    glb_info = (struct apfs_glb_info*) sb->s_fs_info;
+    if (glb_info->encoding) {
+        ret = utf8_strncasecmp(glb_info->encoding, &qa, &qb);
+        if (ret >= 0)
+            return ret;
+    }
+#endif
+
+    if (alen != blen)
+        return 1;
+    return memcmp(a, b, alen);
+}
+
+/*
+ * Compare the name of a directory record with a name. The comparison
+ * depends on the case sensitivity of the volume.
+ */
+int apfs_name_cmp(struct super_block* sb, const char* name, unsigned int len,
+        const char* str)
+{
+    struct apfs_glb_info* glb_info;
+
+    glb_info = (struct apfs_glb_info*) sb->s_fs_info;
+
+    if (!(glb_info->vol_incompat & APFS_INCOMPAT_CASE_INSENSITIVE))
+        return strlen(str) != len || memcmp(name, str, len);
+
+    return cmp_names(sb, name, len, str, strlen(str));
+}
+
+/*
+ * Calculate the hash of the casefolded name. ASCII names use the fast
+ * path; the rest of names are casefolded before hashing, so an ASCII name
+ * and its unicode equivalent have the same hash.
+ */
+static u_int32_t hash_ci_name(struct super_block* sb, const void* salt,
+        const struct qstr* str)
+{
+#if IS_ENABLED(CONFIG_UNICODE)
+    struct apfs_glb_info* glb_info;
+    unsigned char folded[NAME_MAX + 1];
+    int len;
+#endif
+
+    if (is_ascii_name(str->name, str->len))
+        return hash_folded_name(salt, str->name, str->len);
+
+#if IS_ENABLED(CONFIG_UNICODE)
+    glb_info = (struct apfs_glb_info*) sb->s_fs_info;
+    if (glb_info->encoding) {
+        len = utf8_casefold(glb_info->encoding, str, folded, sizeof(folded));
+        if (len > 0)
+            return hash_folded_name(salt, (char*) folded, len);
+    }
+#endif
+
+    return hash_folded_name(salt, str->name, str->len);
+}
+
+static int apfs_ci_hash(const struct dentry* dentry, struct qstr* str)
+{
+    str->hash = hash_ci_name(dentry->d_sb, dentry, str);
+    return 0;
+}
+
+/*
+ * Returns a hash of a name that doesn't depend on the directory. The names
+ * that are equal for apfs_name_cmp() have the same hash.
+ */
+u_int32_t apfs_name_hash(struct super_block* sb, const char* name,
+        unsigned int len)
+{
+    struct apfs_glb_info* glb_info;
+    const struct qstr str = QSTR_INIT(name, len);
+
+    glb_info = (struct apfs_glb_info*) sb->s_fs_info;
+
+    if (!(glb_info->vol_incompat & APFS_INCOMPAT_CASE_INSENSITIVE))
+        return full_name_hash(NULL, name, len);
+
+    return hash_ci_name(sb, NULL, &str);
+}
+
+/*
+ * Called under RCU in path walk mode, it must not block. The name of the
+ * dentry may be changed by a concurrent rename while it's compared. The
+ * inline names are changed in place, so they are copied first; the
+ * external names are freed after a grace period and never change. As in
+ * generic_ci_d_compare(), the barrier keeps the compiler from reading the
+ * name again instead of the copy.
+ */
+static int apfs_ci_compare(const struct dentry* dentry, unsigned int len,
+        const char* str, const struct qstr* name)
+{
+    char strbuf[DNAME_INLINE_LEN];
+
+    if (len <= DNAME_INLINE_LEN - 1) {
+        memcpy(strbuf, str, len);
+        strbuf[len] = 0;
+        str = strbuf;
+        barrier();
+    }
+
+    return cmp_names(dentry->d_sb, str, len, name->name, name->len);
+}
+
+const struct dentry_operations apfs_ci_dentry_operations = {
+    .d_hash = apfs_ci_hash,
+    .d_compare = apfs_ci_compare,
+};
@@ -16,118 +16,607 @@
  */
 
 #include <linux/fs.h>
-#include <linux/buffer_head.h>
+#include <linux/slab.h>
+#include <linux/log2.h>
+#include <linux/bitops.h>
+#include <linux/ktime.h>
 
 #include "apfs.h"
 #include "apfs/volume.h"
 
 /*
- * This is a recursive function. The records for an object can be distributed
- * in different nodes in the B-Tree. For this reason, the function starts in a
- * node branch. There can be two possibilities:
- *  - It is a non-leaf node: for each record, the function reads the disk 
- *    block and then calls itself.
- *  - It's a leaf node: for each record, the function checks that the record 
- *    type is APFS_TYPE_FILE_EXTENT. If it is, the function 'emit' the 
- *    directory. 
- */
-static void list_dir(struct apfs_btree_node_phys_t* node,
-        struct super_block* sb, struct file* filp, struct dir_context *ctx)
-{
-    struct buffer_head* bh;
+ * Entries found by a listing of an open directory, used to build the
+ * listing cache and the Bloom filter once the listing reaches the end.
+ * 'pos' is where the next call must start; if the directory is read from
+ * elsewhere, the listing is not complete and the entries are dropped.
+ */
+struct apfs_dir_builder {
+    loff_t pos;
+    bool failed;
+    unsigned int count;
+    unsigned int size;
+    struct apfs_dirent* entries;
+    size_t names_len;
+    size_t names_size;
+    char* names;
+};
+
+static void free_dir_builder(struct apfs_dir_builder* builder)
+{
+    if (!builder)
+        return;
+
+    kvfree(builder->entries);
+    kvfree(builder->names);
+    kfree(builder);
+}
+
+/*
+ * Grow a buffer of the builder to hold at least 'need' bytes.
+ */
+static bool grow_buffer(void** buf, size_t* size, size_t used, size_t need)
+{
+    void* new;
+    size_t new_size;
+
+    if (need <= *size)
+        return true;
+
+    new_size = max_t(size_t, need, *size ? *size * 2 : PAGE_SIZE);
+    new = kvmalloc(new_size, GFP_KERNEL);
+    if (!new)
+        return false;
+    memcpy(new, *buf, used);
+    kvfree(*buf);
+    *buf = new;
+    *size = new_size;
+
+    return true;
+}
+
+static bool add_dir_entry(struct apfs_dir_builder* builder, loff_t pos,
+        u_int64_t ino, u_int8_t type, const char* name, unsigned int len)
+{
+    struct apfs_dirent* e;
+    size_t size;
+
+    size = builder->size * sizeof(*e);
+    if (!grow_buffer((void**) &builder->entries, &size,
+                builder->count * sizeof(*e), (builder->count + 1) * sizeof(*e)))
+        return false;
+    builder->size = size / sizeof(*e);
+
+    if (!grow_buffer((void**) &builder->names, &builder->names_size,
+                builder->names_len, builder->names_len + len))
+        return false;
+
+    e = &builder->entries[builder->count++];
+    e->ino = ino;
+    e->pos = pos;
+    e->type = type;
+    e->name_off = builder->names_len;
+    e->name_len = len;
+    memcpy(builder->names + builder->names_len, name, len);
+    builder->names_len += len;
+
+    return true;
+}
+
+/*
+ * Returns the 'n'-th bit of the filter for a hash, with double hashing.
+ */
+static inline u_int32_t bloom_bit(u_int32_t hash, int n, u_int32_t mask)
+{
+    return (hash + n * (ror32(hash, 17) | 1)) & mask;
+}
+
+/*
+ * Build the filter of a directory from all its names and publish it. If
+ * another listing published a filter first, it's kept.
+ */
+static void publish_bloom(struct inode* inode,
+        struct apfs_dir_builder* builder)
+{
+    struct apfs_dir_bloom* bloom;
+    struct apfs_dirent* e;
+    unsigned long nbits;
+    u_int32_t hash;
+    unsigned int c;
+    int n;
+
+    nbits = roundup_pow_of_two(max_t(unsigned long, BITS_PER_LONG,
+                (unsigned long) builder->count * APFS_DIR_BLOOM_BITS_ENTRY));
+    bloom = kzalloc(sizeof(*bloom) + BITS_TO_LONGS(nbits) * sizeof(long),
+            GFP_KERNEL);
+    if (!bloom)
+        return;
+
+    bloom->mask = nbits - 1;
+    for (c = 0; c < builder->count; c++) {
+        e = &builder->entries[c];
+        hash = apfs_name_hash(inode->i_sb, builder->names + e->name_off,
+                e->name_len);
+        for (n = 0; n < APFS_DIR_BLOOM_PROBES; n++)
+            __set_bit(bloom_bit(hash, n, bloom->mask), bloom->bits);
+    }
+
+    if (cmpxchg(&APFS_I(inode)->dir_bloom, NULL, bloom))
+        kfree(bloom);
+}
+
+static void free_dir_cache_rcu(struct rcu_head* head)
+{
+    kvfree(container_of(head, struct apfs_dir_cache, rcu));
+}
+
+static void put_dir_cache(struct apfs_dir_cache* cache)
+{
+    if (cache && refcount_dec_and_test(&cache->refcnt))
+        call_rcu(&cache->rcu, free_dir_cache_rcu);
+}
+
+/*
+ * Detach the listing cache of the directory. The caller must hold the lock
+ * of the LRU list and put the returned cache.
+ */
+static struct apfs_dir_cache* detach_dir_cache(struct apfs_inode_lru* lru,
+        struct apfs_inode_info* ai)
+{
+    struct apfs_dir_cache* cache;
+
+    cache = rcu_dereference_protected(ai->dir_cache,
+            lockdep_is_held(&lru->lock));
+    if (!cache)
+        return NULL;
+
+    RCU_INIT_POINTER(ai->dir_cache, NULL);
+    list_del_init(&ai->dir_lru);
+    lru->count--;
+
+    return cache;
+}
+
+static bool dir_cache_evict(struct list_head* entry, void* arg)
+{
+    struct apfs_inode_info* ai;
+
+    ai = list_entry(entry, struct apfs_inode_info, dir_lru);
+    if (test_and_clear_bit(APFS_DIR_REFERENCED, &ai->flags))
+        return false;
+
+    put_dir_cache(detach_dir_cache((struct apfs_inode_lru*) arg, ai));
+
+    return true;
+}
+
+/*
+ * Release the listing caches of up to 'nr' directories from the LRU list.
+ * Returns the number of caches released.
+ */
+unsigned long apfs_dir_lru_shrink(struct apfs_inode_lru* lru,
+        unsigned long nr)
+{
+    unsigned long freed;
+
+    spin_lock(&lru->lock);
+    freed = apfs_lru_walk(&lru->list, lru->count, nr, dir_cache_evict, lru);
+    spin_unlock(&lru->lock);
+
+    return freed;
+}
+
+/*
+ * Release the listing cache of a directory that is being destroyed.
+ */
+void apfs_drop_dir_cache(struct inode* inode)
+{
+    struct apfs_glb_info* glb_info;
+    struct apfs_inode_lru* lru;
+
+    glb_info = (struct apfs_glb_info*) inode->i_sb->s_fs_info;
+    lru = &glb_info->dir_lru;
+
+    spin_lock(&lru->lock);
+    put_dir_cache(detach_dir_cache(lru, APFS_I(inode)));
+    spin_unlock(&lru->lock);
+}
+
+/*
+ * Copy the entries of a complete listing to a new cache and add it to the
+ * directory, unless another listing did it first.
+ */
+static void publish_dir_cache(struct inode* inode,
+        struct apfs_dir_builder* builder)
+{
+    struct apfs_glb_info* glb_info;
+    struct apfs_inode_lru* lru;
+    struct apfs_inode_info* ai;
+    struct apfs_dir_cache* cache;
+    size_t entries_size;
+    unsigned long over;
+
+    glb_info = (struct apfs_glb_info*) inode->i_sb->s_fs_info;
+    lru = &glb_info->dir_lru;
+    ai = APFS_I(inode);
+
+    entries_size = builder->count * sizeof(*builder->entries);
+    cache = kvmalloc(sizeof(*cache) + entries_size + builder->names_len,
+            GFP_KERNEL);
+    if (!cache)
+        return;
+
+    refcount_set(&cache->refcnt, 1);
+    cache->count = builder->count;
+    cache->names = (char*) cache->entries + entries_size;
+    memcpy(cache->entries, builder->entries, entries_size);
+    memcpy(cache->names, builder->names, builder->names_len);
+
+    spin_lock(&lru->lock);
+    if (rcu_access_pointer(ai->dir_cache)) {
+        spin_unlock(&lru->lock);
+        put_dir_cache(cache);
+        return;
+    }
+    rcu_assign_pointer(ai->dir_cache, cache);
+    list_add(&ai->dir_lru, &lru->list);
+    lru->count++;
+    over = lru->count > lru->max ? lru->count - lru->max : 0;
+    spin_unlock(&lru->lock);
+
+    if (over)
+        apfs_dir_lru_shrink(lru, over);
+}
+
+static struct apfs_dir_cache* grab_dir_cache(struct apfs_inode_info* ai)
+{
+    struct apfs_dir_cache* cache;
+
+    rcu_read_lock();
+    cache = rcu_dereference(ai->dir_cache);
+    if (cache && !refcount_inc_not_zero(&cache->refcnt))
+        cache = NULL;
+    rcu_read_unlock();
+
+    return cache;
+}
+
+/*
+ * Emit the entries of a cached listing from the position of the context.
+ */
+static void list_dir_cached(struct apfs_dir_cache* cache,
+        struct dir_context* ctx)
+{
+    struct apfs_dirent* e;
+    unsigned int left, right, mid;
+
+    left = 0;
+    right = cache->count;
+    while (left < right) {
+        mid = left + (right - left) / 2;
+        if (cache->entries[mid].pos < ctx->pos)
+            left = mid + 1;
+        else
+            right = mid;
+    }
+
+    for (; left < cache->count; left++) {
+        e = &cache->entries[left];
+        ctx->pos = e->pos;
+        if (!dir_emit(ctx, cache->names + e->name_off, e->name_len, e->ino,
+                    e->type))
+            return;
+    }
+
+    ctx->pos = APFS_DIR_POS_EOF;
+}
+
+/*
+ * Returns false if the name is not in the directory for sure. Without a
+ * filter, any name may be in the directory.
+ */
+bool apfs_dir_may_contain(struct inode* dir, const struct qstr* name)
+{
+    struct apfs_dir_bloom* bloom;
+    u_int32_t hash;
+    bool ret;
+    int n;
+
+    if (!rcu_access_pointer(APFS_I(dir)->dir_bloom))
+        return true;
+
+    hash = apfs_name_hash(dir->i_sb, name->name, name->len);
+    ret = true;
+
+    rcu_read_lock();
+    bloom = rcu_dereference(APFS_I(dir)->dir_bloom);
+    for (n = 0; n < APFS_DIR_BLOOM_PROBES; n++) {
+        if (!test_bit(bloom_bit(hash, n, bloom->mask), bloom->bits)) {
+            ret = false;
+            break;
+        }
+    }
+    rcu_read_unlock();
+
+    return ret;
+}
+
+/*
+ * Returns the builder of an open directory for a call that starts at
+ * 'ctx->pos', NULL if the entries of this call must not be recorded. A
+ * builder is created when a listing starts from the first entry of a
+ * directory; its entries are kept if the listings can be cached or the
+ * directory needs a filter.
+ */
+static struct apfs_dir_builder* get_dir_builder(struct file* filp,
+        struct dir_context* ctx)
+{
+    struct apfs_glb_info* glb_info;
+    struct apfs_dir_builder* builder;
     struct inode* inode;
+
+    inode = file_inode(filp);
+    glb_info = (struct apfs_glb_info*) inode->i_sb->s_fs_info;
+    builder = filp->private_data;
+
+    if (builder && builder->pos == ctx->pos)
+        return builder;
+
+    free_dir_builder(builder);
+    filp->private_data = NULL;
+
+    if (ctx->pos != 2)
+        return NULL;
+    if (!glb_info->dir_lru.max && (!glb_info->dir_bloom_min
+                || rcu_access_pointer(APFS_I(inode)->dir_bloom)))
+        return NULL;
+
+    builder = kzalloc(sizeof(*builder), GFP_KERNEL);
+    filp->private_data = builder;
+
+    return builder;
+}
+
+/*
+ * Keep the entries of a listing that reached the end: the listing is
+ * cached and, if the directory is big enough, its filter is built.
+ */
+static void publish_dir_builder(struct inode* inode,
+        struct apfs_dir_builder* builder)
+{
     struct apfs_glb_info* glb_info;
-    struct apfs_record_drec_key_t* drec_key;
+
+    glb_info = (struct apfs_glb_info*) inode->i_sb->s_fs_info;
+
+    if (glb_info->dir_lru.max)
+        publish_dir_cache(inode, builder);
+    if (glb_info->dir_bloom_min && builder->count >= glb_info->dir_bloom_min
+            && !rcu_access_pointer(APFS_I(inode)->dir_bloom))
+        publish_bloom(inode, builder);
+}
+
+/*
+ * Returns the length of the name of a directory record without the null
+ * character, or -1 if the name doesn't fit in the key or it isn't
+ * null-terminated.
+ */
+static int drec_name_len(struct apfs_record_drec_hashed_key_t* drec_key,
+        int key_len)
+{
+    int name_len;
+
+    name_len = le32_to_cpu(drec_key->name_len_and_hash) & APFS_DREC_LEN_MASK;
+    if (key_len < sizeof(*drec_key) || name_len == 0
+            || sizeof(*drec_key) + name_len > key_len
+            || drec_key->name[name_len - 1] != '\0')
+        return -1;
+
+    return name_len - 1;
+}
+
+/*
+ * Emit the directory entries of the inode from the position of the
+ * context. Only the APFS_TYPE_DIR_REC records of the inode are scanned, and
+ * the scan starts with a seek to the hash of the position, so the listing
+ * reads just the leaves that hold the entries not emitted yet.
+ */
+static int list_dir(struct inode* inode, struct dir_context *ctx,
+        struct apfs_ino_batch* batch, struct apfs_dir_builder* builder)
+{
+    struct apfs_btree_cursor cur;
+    struct apfs_record_drec_hashed_key_t* drec_key;
     struct apfs_record_drec_val_t* drec_val;
-    struct apfs_btree_node_phys_t* node_chl;
-    struct apfs_kvloc_t* kvloc;
-    u_int8_t* key_zone;
-    u_int8_t* val_zone;
-    u_int8_t* toc_zone;
-    int ckeys;
+    u_int32_t start_hash;
+    u_int32_t hash;
+    u_int32_t prev_hash;
+    unsigned int skip;
+    unsigned int dup;
+    loff_t pos;
     int entry_type;
-    
-    glb_info = (struct apfs_glb_info*) sb->s_fs_info;
-    inode = filp->f_path.dentry->d_inode;
-        
-    toc_zone = get_toc_zone(node); 
-    key_zone = get_key_zone(node);
-    val_zone = get_val_zone(sb, node);
-    kvloc = (struct apfs_kvloc_t*) toc_zone;
-    
-    /*
-     * Iterate for over each record of the node
-     */ 
-    for (ckeys = 0; ckeys<le32_to_cpu(node->btn_nkeys); ckeys++, kvloc++) {
+    int key_len;
+    int val_len;
+    int name_len;
+    int ret;
+
+    start_hash = 0;
+    skip = 0;
+    if (ctx->pos >= APFS_DIR_POS_FIRST) {
+        pos = ctx->pos - APFS_DIR_POS_FIRST;
+        start_hash = pos >> APFS_DIR_POS_DUP_BITS;
+        skip = pos & APFS_DIR_POS_DUP_MAX;
+    }
+
+    apfs_fstree_cursor_init(&cur, inode->i_sb);
+    apfs_btree_cursor_hint(&cur, &APFS_I(inode)->data_hint);
+
+    dup = 0;
+    prev_hash = U32_MAX;
+    for (ret = apfs_btree_range_from(&cur, inode->i_ino, APFS_TYPE_DIR_REC,
+                start_hash << APFS_DREC_HASH_SHIFT);
+            ret > 0; ret = apfs_btree_range_next(&cur)) {
+        drec_key = (struct apfs_record_drec_hashed_key_t*)
+            apfs_btree_key(&cur, &key_len);
+        drec_val = (struct apfs_record_drec_val_t*)
+            apfs_btree_val(&cur, &val_len);
+
+        hash = (le32_to_cpu(drec_key->name_len_and_hash)
+                & APFS_DREC_HASH_MASK) >> APFS_DREC_HASH_SHIFT;
+        dup = hash == prev_hash ? dup + 1 : 0;
+        prev_hash = hash;
+        if (hash == start_hash && dup < skip)
+            continue;
+
         /*
-         * If it is not a leaf node, we go to the child node of the tree.
+         * The corrupt records are skipped, but they keep their position,
+         * so the positions of the next entries don't change.
          */
-        if (node->btn_level != 0) {
-            bh = get_fstree_child(sb, node, kvloc);
-            if (!bh)
-                continue;
-            node_chl = (struct apfs_btree_node_phys_t*) bh->b_data;        
-            list_dir(node_chl, sb, filp, ctx); 
-            brelse(bh);
+        name_len = drec_name_len(drec_key, key_len);
+        if (name_len < 0 || val_len < sizeof(*drec_val)) {
+            printk(KERN_ERR "apfs: invalid directory record in inode [%lu]\n",
+                    inode->i_ino);
             continue;
         }
         
-        /*
-         * It's a leaf node, we look for the directory entries.
-         */        
-        drec_key = (struct apfs_record_drec_key_t*) (key_zone + le16_to_cpu(kvloc->k.off));
-        drec_val = (struct apfs_record_drec_val_t*) (val_zone - le16_to_cpu(kvloc->v.off));
+        switch (le16_to_cpu(drec_val->flags) & APFS_DREC_TYPE_MASK) {
+        case APFS_DT_DIR:
+            entry_type = DT_DIR;
+            break;
+        case APFS_DT_REG:
+            entry_type = DT_REG;
+            break;
+        case APFS_DT_LNK:
+            entry_type = DT_LNK;
+            break;
+        default:
+            continue;
+        }
         
-        if (get_fs_obj_id(&(drec_key->hdr)) == inode->i_ino 
-                && get_fs_obj_type(&(drec_key->hdr)) == APFS_TYPE_DIR_REC) {
-            if (le16_to_cpu(drec_val->flags) & APFS_DREC_TYPE_MASK & APFS_DT_DIR)
-                entry_type = DT_DIR;
-            else if (le16_to_cpu(drec_val->flags) & APFS_DREC_TYPE_MASK & APFS_DT_REG)
-                entry_type = DT_REG;
-            else 
-                continue;
-            
-            dir_emit(ctx, normalize_string(drec_key->name), 
-                    strlen(normalize_string(drec_key->name)), 
-                    le64_to_cpu(drec_val->file_id), entry_type);
-            ctx->pos++;
+        ctx->pos = apfs_drec_pos(hash, dup);
+        if (!dir_emit(ctx, drec_key->name, name_len,
+                    le64_to_cpu(drec_val->file_id), entry_type))
+            break;
+
+        if (builder && !builder->failed)
+            builder->failed = !add_dir_entry(builder, ctx->pos,
+                    le64_to_cpu(drec_val->file_id), entry_type,
+                    drec_key->name, name_len);
+
+        /*
+         * Remember the regular files and directories, so their inodes
+         * are read before the stat() calls that usually follow.
+         */
+        if (batch && (entry_type == DT_DIR || entry_type == DT_REG)) {
+            batch->entries[batch->count].ino = le64_to_cpu(drec_val->file_id);
+            batch->entries[batch->count].mode =
+                entry_type == DT_DIR ? S_IFDIR : S_IFREG;
+            if (++batch->count == APFS_INO_BATCH_SIZE)
+                apfs_prefetch_inodes(inode, batch);
         }
     }
+
+    apfs_btree_cursor_release(&cur);
+    if (ret < 0)
+        return ret;
+
+    /*
+     * The entry that didn't fit is emitted again in the next call.
+     */
+    if (ret == 0)
+        ctx->pos = APFS_DIR_POS_EOF;
+
+    return 0;
 } 
 
-static int apfs_iterate(struct file* filp, struct dir_context *ctx)
+/*
+ * List the directory from the position of the context. It can run in
+ * parallel with other listings and lookups of the same directory: all its
+ * state is in the context, the stack and the open file, and the caches it
+ * uses are safe for concurrent readers. Once a listing reached the end,
+ * the following ones are copied from the listing cache of the directory.
+ */
+static int iterate_dir_records(struct file* filp, struct dir_context *ctx)
 {
     struct inode* inode;
-    struct super_block* sb;
-    struct buffer_head* bh;
-    struct apfs_btree_node_phys_t* node;
+    struct apfs_inode_info* ai;
+    struct apfs_dir_cache* cache;
+    struct apfs_ino_batch* batch;
+    struct apfs_dir_builder* builder;
+    int err;
     
-    if(ctx->pos != 0)
+    if (ctx->pos >= APFS_DIR_POS_EOF)
         return 0;
     
-    inode = filp->f_path.dentry->d_inode;
-    sb = inode->i_sb;
+    inode = file_inode(filp);
+    ai = APFS_I(inode);
         
-    if (!dir_emit_dots(filp, ctx)) {
-        return -ENOMEM;
-    }
-    ctx->pos = 2;
-        
-    bh = get_inode_branch(sb, inode->i_ino);
-    if (!bh)
+    if (!dir_emit_dots(filp, ctx))
         return 0;
+
+    cache = grab_dir_cache(ai);
+    if (cache) {
+        if (!test_bit(APFS_DIR_REFERENCED, &ai->flags))
+            set_bit(APFS_DIR_REFERENCED, &ai->flags);
+        list_dir_cached(cache, ctx);
+        put_dir_cache(cache);
+        return 0;
+    }
     
-    node = (struct apfs_btree_node_phys_t*) bh->b_data;        
-    list_dir(node, sb, filp, ctx); 
-    
-    brelse(bh);
+    /*
+     * If there's no memory for the batch, the directory is listed anyway.
+     */
+    batch = kmalloc(sizeof(*batch), GFP_KERNEL);
+    if (batch)
+        batch->count = 0;
+
+    builder = get_dir_builder(filp, ctx);
+
+    err = list_dir(inode, ctx, batch, builder); 
+
+    if (batch) {
+        apfs_prefetch_inodes(inode, batch);
+        kfree(batch);
+    }
+
+    /*
+     * The entries are kept when a listing from the first entry reaches
+     * the end without errors.
+     */
+    if (builder) {
+        builder->pos = ctx->pos;
+        if (err || builder->failed || ctx->pos >= APFS_DIR_POS_EOF) {
+            if (!err && !builder->failed)
+                publish_dir_builder(inode, builder);
+            free_dir_builder(builder);
+            filp->private_data = NULL;
+        }
+    }
         
+    return err;
+}
+
+static int apfs_dir_release(struct inode* inode, struct file* filp)
+{
+    free_dir_builder(filp->private_data);
     return 0;
 }
 
+static int apfs_iterate(struct file* filp, struct dir_context *ctx)
+{
+    u_int64_t start;
+    int err;
+
+    start = ktime_get_ns();
+    err = iterate_dir_records(filp, ctx);
+    apfs_lat_record(file_inode(filp)->i_sb, APFS_LAT_READDIR, start);
+
+    return err;
+}
+
 struct file_operations apfs_dir_operations = {
     .owner = THIS_MODULE,
     .read = generic_read_dir,
     .llseek = generic_file_llseek,
-    .iterate = apfs_iterate,
+    .iterate_shared = apfs_iterate,
+    .release = apfs_dir_release,
+    .unlocked_ioctl = apfs_dir_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
 };
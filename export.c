@@ -0,0 +1,129 @@
+/*
+ * This file is part of the APFS-Module.
+ * Copyright (c) 2019 Jordi Barcons.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/exportfs.h>
+
+#include "apfs.h"
+#include "apfs/volume.h"
+
+/*
+ * The file handles contain the object id of the inode, and the one of its
+ * parent when it's requested. The object ids are never reused in a volume,
+ * so the handles don't need a generation number.
+ */
+#define APFS_FILEID_INO         0xa1
+#define APFS_FILEID_INO_PARENT  0xa2
+
+#define APFS_FH_INO_LEN         2   /* In 32-bit words */
+#define APFS_FH_PARENT_LEN      4
+
+static void fh_put_ino(__u32* fh, u_int64_t ino)
+{
+    fh[0] = (u32) ino;
+    fh[1] = (u32) (ino >> 32);
+}
+
+static u_int64_t fh_get_ino(__u32* fh)
+{
+    return (u_int64_t) fh[0] | ((u_int64_t) fh[1] << 32);
+}
+
+static int apfs_encode_fh(struct inode* inode, __u32* fh, int* max_len,
+        struct inode* parent)
+{
+    int len;
+
+    len = parent ? APFS_FH_PARENT_LEN : APFS_FH_INO_LEN;
+    if (*max_len < len) {
+        *max_len = len;
+        return FILEID_INVALID;
+    }
+
+    fh_put_ino(fh, inode->i_ino);
+    if (parent)
+        fh_put_ino(fh + APFS_FH_INO_LEN, parent->i_ino);
+    *max_len = len;
+
+    return parent ? APFS_FILEID_INO_PARENT : APFS_FILEID_INO;
+}
+
+/*
+ * Returns a dentry of the inode 'ino', read directly from its inode record
+ * unless it's in the inode cache.
+ */
+static struct dentry* apfs_ino_to_dentry(struct super_block* sb,
+        u_int64_t ino)
+{
+    struct inode* inode;
+
+    if (ino < ROOT_DIR_INO_NUM)
+        return ERR_PTR(-ESTALE);
+
+    inode = get_apfs_inode(sb, NULL, ino, 0);
+    if (!inode)
+        return ERR_PTR(-ESTALE);
+
+    return d_obtain_alias(inode);
+}
+
+static struct dentry* apfs_fh_to_dentry(struct super_block* sb,
+        struct fid* fid, int fh_len, int fh_type)
+{
+    if ((fh_type != APFS_FILEID_INO && fh_type != APFS_FILEID_INO_PARENT)
+            || fh_len < APFS_FH_INO_LEN)
+        return NULL;
+
+    return apfs_ino_to_dentry(sb, fh_get_ino(fid->raw));
+}
+
+static struct dentry* apfs_fh_to_parent(struct super_block* sb,
+        struct fid* fid, int fh_len, int fh_type)
+{
+    if (fh_type != APFS_FILEID_INO_PARENT || fh_len < APFS_FH_PARENT_LEN)
+        return NULL;
+
+    return apfs_ino_to_dentry(sb, fh_get_ino(fid->raw + APFS_FH_INO_LEN));
+}
+
+/*
+ * The parent of a directory is the parent_id of its inode record.
+ */
+static struct dentry* apfs_get_parent(struct dentry* child)
+{
+    struct apfs_record_inode_val_t* apfs_inode;
+    struct inode* inode;
+    u_int64_t parent;
+
+    inode = d_inode(child);
+    apfs_inode = get_inode_from_disk(inode->i_sb, inode->i_ino,
+            &APFS_I(inode)->rec_hint);
+    if (!apfs_inode)
+        return ERR_PTR(-EIO);
+    parent = le64_to_cpu(apfs_inode->parent_id);
+    kfree(apfs_inode);
+
+    return apfs_ino_to_dentry(inode->i_sb, parent);
+}
+
+const struct export_operations apfs_export_ops = {
+    .encode_fh = apfs_encode_fh,
+    .fh_to_dentry = apfs_fh_to_dentry,
+    .fh_to_parent = apfs_fh_to_parent,
+    .get_parent = apfs_get_parent,
+};
@@ -16,135 +16,308 @@
  */
 
 #include <linux/fs.h>
-#include <linux/buffer_head.h>
 #include <linux/slab.h>
+#include <linux/ktime.h>
 
 #include "apfs.h"
 #include "apfs/volume.h"
 
 /*
- * This is a recursive function. The records for an object can be distributed
- * in different nodes in the B-Tree. For this reason, the function starts in a
- * node branch. There can be two possibilities:
- *  - It is a non-leaf node: for each record, the function reads the disk 
- *    block and then calls itself.
- *  - It's a leaf node: for each record, the function checks that the record 
- *    type is APFS_TYPE_FILE_EXTENT. Next, we verify if the EXTENT containts
- *    the data requested by the user.
+ * Decode the extent record of the object 'oid' in the current position of
+ * the cursor. Returns -ENOENT if the cursor is not in an extent of 'oid'.
  */
-static size_t read_data (struct apfs_btree_node_phys_t* node,
-        struct super_block* sb, struct file* filp, char __user* buf,
-        size_t len, loff_t* ppos)
+static int cursor_extent(struct apfs_btree_cursor* cur, u_int64_t oid,
+        struct apfs_extent* ext)
 {
-    struct buffer_head* bh;
-    struct buffer_head* bh_data;
-    struct inode* inode;
-    struct apfs_glb_info* glb_info;
     struct apfs_record_file_extent_key_t* ext_key;
     struct apfs_record_file_extent_val_t* ext_val;
-    struct apfs_btree_node_phys_t* node_chl;
-    struct apfs_kvloc_t* kvloc;
-    size_t file_len, rst_data, bytes_to_read, ret;
-    u_int8_t* key_zone;
-    u_int8_t* val_zone;
-    u_int8_t* toc_zone;
-    int ckeys, ext_len, block_size;
-    
-    glb_info = (struct apfs_glb_info*) sb->s_fs_info;
-    block_size = sb->s_blocksize;
-
-    inode = filp->f_path.dentry->d_inode;
-    file_len = inode->i_size;
-    rst_data = file_len-(*ppos);
-    bytes_to_read = min(rst_data, len);
-        
-    toc_zone = get_toc_zone(node); 
-    key_zone = get_key_zone(node);
-    val_zone = get_val_zone(sb, node);
-    kvloc = (struct apfs_kvloc_t*) toc_zone;
-    
-    /*
-     * Iterate for over each record of the node
-     */
-    for (ckeys = 0; ckeys<le32_to_cpu(node->btn_nkeys); ckeys++, kvloc++) {
-        /*
-         * If it is not a leaf node, we go to the child node of the tree.
-         */
-        if (le16_to_cpu(node->btn_level) != 0) {
-            bh = get_fstree_child(sb, node, kvloc);
-            if (!bh)
+    u_int64_t k_oid;
+    u_int8_t type;
+    int len;
+
+    if (cur->index[cur->depth - 1] < 0)
+        return -ENOENT;
+
+    apfs_btree_key_id(cur, &k_oid, &type);
+    if (k_oid != oid || type != APFS_TYPE_FILE_EXTENT)
+        return -ENOENT;
+
+    ext_key = (struct apfs_record_file_extent_key_t*) apfs_btree_key(cur, &len);
+    ext_val = (struct apfs_record_file_extent_val_t*) apfs_btree_val(cur, &len);
+    if (len < sizeof(*ext_val))
+        return -EIO;
+
+    ext->logical = le64_to_cpu(ext_key->logical_addr);
+    ext->len = le64_to_cpu(ext_val->len_and_flags)
+        & APFS_RECORD_FILE_EXTENT_LEN_MASK;
+    ext->phys = le64_to_cpu(ext_val->phys_block_num);
+
+    return 0;
+}
+
+/*
+ * Find the extent of the object 'oid' that contains the byte 'offset'. The
+ * tree is descended with the key (oid, APFS_TYPE_FILE_EXTENT, offset) and
+ * the greatest key smaller or equal is taken, so the cost doesn't depend on
+ * the number of extents of the file. Returns -ENOENT if there's no extent
+ * for the offset.
+ */
+int apfs_find_extent(struct apfs_btree_cursor* cur, u_int64_t oid,
+        u_int64_t offset, struct apfs_extent* ext)
+{
+    int ret;
+
+    ret = apfs_btree_seek(cur, oid, APFS_TYPE_FILE_EXTENT, offset);
+    if (ret < 0)
+        return ret;
+
+    ret = cursor_extent(cur, oid, ext);
+    if (ret)
+        return ret;
+
+    if (offset >= ext->logical + ext->len)
+        return -ENOENT;
+
+    return 0;
+}
+
+static inline bool extent_has(struct apfs_extent* ext, u_int64_t pos)
+{
+    return ext->len && pos >= ext->logical && pos < ext->logical + ext->len;
+}
+
+/*
+ * Returns the extent of the inode that contains the byte 'pos'. The inode
+ * keeps the last extent found and the one that follows it, so the reads
+ * that reach the end of an extent find the next one without a seek. When
+ * an extent is read from the tree, the next record is read with the same
+ * cursor, as it's usually in the same leaf.
+ */
+static int map_extent(struct inode* inode, struct apfs_btree_cursor* cur,
+        u_int64_t pos, struct apfs_extent* ext)
+{
+    struct apfs_inode_info* ai;
+    struct apfs_extent next;
+    int c, err;
+
+    ai = APFS_I(inode);
+
+    spin_lock(&ai->ext_lock);
+    for (c = 0; c < 2; c++) {
+        if (extent_has(&ai->ext[c], pos)) {
+            *ext = ai->ext[c];
+            spin_unlock(&ai->ext_lock);
+            return 0;
+        }
+    }
+    spin_unlock(&ai->ext_lock);
+
+    err = apfs_find_extent(cur, inode->i_ino, pos, ext);
+    if (err)
+        return err;
+
+    memset(&next, 0, sizeof(next));
+    if (apfs_btree_next(cur) > 0 && !cursor_extent(cur, inode->i_ino, &next)
+            && next.logical != ext->logical + ext->len)
+        memset(&next, 0, sizeof(next));
+
+    spin_lock(&ai->ext_lock);
+    ai->ext[0] = *ext;
+    ai->ext[1] = next;
+    spin_unlock(&ai->ext_lock);
+
+    return 0;
+}
+
+/*
+ * Fill a page of the page cache with the file data. The mount rejects
+ * blocks smaller than a page, so the page is inside a single extent. The
+ * bytes after the end of the file and the holes are read as zeros.
+ */
+static int apfs_readpage(struct file* filp, struct page* page)
+{
+    struct inode* inode;
+    struct super_block* sb;
+    struct apfs_btree_cursor cur;
+    struct apfs_extent ext;
+    u_int64_t pos;
+    loff_t size;
+    int err;
+
+    inode = page->mapping->host;
+    sb = inode->i_sb;
+    pos = (u_int64_t) page->index << PAGE_SHIFT;
+    size = i_size_read(inode);
+
+    if (pos >= size) {
+        zero_user(page, 0, PAGE_SIZE);
+        goto uptodate;
+    }
+
+    apfs_fstree_cursor_init(&cur, sb);
+    apfs_btree_cursor_hint(&cur, &APFS_I(inode)->data_hint);
+    err = map_extent(inode, &cur, pos, &ext);
+    apfs_btree_cursor_release(&cur);
+    if (err == -ENOENT || (!err && ext.phys == 0)) {
+        zero_user(page, 0, PAGE_SIZE);
+        goto uptodate;
+    }
+    if (err)
+        goto fail;
+
+    err = apfs_read_data_page(sb, page,
+            ext.phys * sb->s_blocksize + (pos - ext.logical));
+    if (err) {
+        printk(KERN_ERR "apfs: unable to read the data of inode [%lu]\n",
+                inode->i_ino);
+        goto fail;
+    }
+    if (size - pos < PAGE_SIZE)
+        zero_user_segment(page, size - pos, PAGE_SIZE);
+
+uptodate:
+    SetPageUptodate(page);
+    unlock_page(page);
+    return 0;
+
+fail:
+    SetPageError(page);
+    unlock_page(page);
+    return err;
+}
+
+/*
+ * Read the pages of a readahead window. The window is split at the
+ * boundaries of the extents, and each physically contiguous run of pages
+ * is read with a single bio, so a fragmented file never gets more bios
+ * than extents in the window and no bio crosses into unrelated blocks.
+ * The pages that can't be mapped are left for readpage.
+ */
+static void apfs_readahead(struct readahead_control* rac)
+{
+    struct inode* inode;
+    struct super_block* sb;
+    struct apfs_btree_cursor cur;
+    struct apfs_extent ext;
+    struct page* page;
+    struct bio* bio;
+    u_int64_t pos, dev_pos, next_pos;
+    unsigned int nr;
+    loff_t size;
+    int err;
+
+    inode = rac->mapping->host;
+    sb = inode->i_sb;
+    size = i_size_read(inode);
+    bio = NULL;
+    next_pos = 0;
+    memset(&ext, 0, sizeof(ext));
+
+    apfs_fstree_cursor_init(&cur, sb);
+    apfs_btree_cursor_hint(&cur, &APFS_I(inode)->data_hint);
+
+    while ((page = readahead_page(rac))) {
+        pos = page_offset(page);
+
+        if (!extent_has(&ext, pos) && pos < size) {
+            err = map_extent(inode, &cur, pos, &ext);
+            if (err == -ENOENT) {
+                ext.logical = pos;
+                ext.len = PAGE_SIZE;
+                ext.phys = 0;
+            } else if (err) {
+                memset(&ext, 0, sizeof(ext));
+                unlock_page(page);
+                put_page(page);
                 continue;
-            node_chl = (struct apfs_btree_node_phys_t*) bh->b_data;        
-            ret = read_data(node_chl, sb, filp, buf, len, ppos); 
-            brelse(bh);
-                        
-            if (ret) {
-                return ret;
             }
+        }
+
+        if (pos >= size || ext.phys == 0) {
+            zero_user(page, 0, PAGE_SIZE);
+            SetPageUptodate(page);
+            unlock_page(page);
+            put_page(page);
             continue;
         }
 
-        /*
-         * It's a leaf node, we look for the extent entries.
-         */
-        ext_key = (struct apfs_record_file_extent_key_t*) (key_zone + le16_to_cpu(kvloc->k.off));
-        ext_val = (struct apfs_record_file_extent_val_t*) (val_zone - le16_to_cpu(kvloc->v.off));
-
-        if (get_fs_obj_id(&(ext_key->hdr)) == inode->i_ino
-                && get_fs_obj_type(&(ext_key->hdr)) == APFS_TYPE_FILE_EXTENT) {
-            ext_len = ext_val->len_and_flags & APFS_RECORD_FILE_EXTENT_LEN_MASK;
-            if (*ppos >= ext_key->logical_addr
-                   && *ppos < ext_key->logical_addr + ext_len) {
-                bytes_to_read = min(bytes_to_read, (size_t)(block_size-(*ppos)%(block_size)));
-                bh_data = sb_bread(inode->i_sb, ext_val->phys_block_num+(*ppos)/(block_size));
-                if (!bh_data) {
-                    printk(KERN_ERR "apfs: unable to read block number\n");
-                    return 0;
-                }
-                if (copy_to_user(buf, (bh_data->b_data)+(*ppos)%(block_size), bytes_to_read)) {
-                    brelse(bh_data);
-                    printk(KERN_ERR
-                            "apfs: error copying data to the userspace buffer\n");
-                    return 0;
-                }
-                
-                *ppos += bytes_to_read;
-                brelse(bh_data);
-                return bytes_to_read;
-            }
+        dev_pos = ext.phys * sb->s_blocksize + (pos - ext.logical);
+        if (bio && (dev_pos != next_pos
+                    || bio_add_page(bio, page, PAGE_SIZE, 0) != PAGE_SIZE)) {
+            submit_bio(bio);
+            bio = NULL;
         }
+        if (!bio) {
+            nr = min_t(u_int64_t, readahead_count(rac) + 1,
+                    DIV_ROUND_UP(ext.logical + ext.len - pos, PAGE_SIZE));
+            bio = apfs_data_bio_alloc(sb, dev_pos, nr);
+            bio_add_page(bio, page, PAGE_SIZE, 0);
+        }
+        next_pos = dev_pos + PAGE_SIZE;
+        put_page(page);
     }
-    
+
+    if (bio)
+        submit_bio(bio);
+    apfs_btree_cursor_release(&cur);
+}
+
+const struct address_space_operations apfs_aops = {
+    .readpage = apfs_readpage,
+    .readahead = apfs_readahead
+};
+
+/*
+ * Reads never block when the data is cached (see apfs_file_read_iter), so
+ * the file can be used with RWF_NOWAIT and io_uring without offloading the
+ * reads to a worker.
+ */
+static int apfs_file_open(struct inode* inode, struct file* filp)
+{
+    int err;
+
+    err = generic_file_open(inode, filp);
+    if (err)
+        return err;
+
+    filp->f_mode |= FMODE_NOWAIT;
+
+    /*
+     * The opens in the order of the directory listing start the prefetch
+     * of the next files.
+     */
+    apfs_seq_open(filp);
+
     return 0;
 }
 
-ssize_t apfs_read(struct file* filp, char __user* buf, size_t len,
-              loff_t* ppos)
+/*
+ * The reads go through the page cache. IOCB_NOWAIT alone still lets
+ * generic_file_read_iter() start the readahead of the missing pages, and
+ * readahead and readpage map the extents with synchronous B-Tree reads.
+ * IOCB_NOIO stops it before any readahead, so a NOWAIT read only copies
+ * the pages already up to date and returns -EAGAIN for the rest, which
+ * are then read by the blocking retry.
+ */
+static ssize_t apfs_file_read_iter(struct kiocb* iocb, struct iov_iter* to)
 {
-    struct inode* inode;
-    struct buffer_head *bh;
-    struct apfs_btree_node_phys_t* node;
-    size_t read_b;
-    
-    inode = filp->f_path.dentry->d_inode;
-    
-    if (inode->i_size <= *ppos)
-        return 0;
-    
-    bh = get_inode_branch(inode->i_sb, inode->i_ino);
-    if (!bh)
-        return 0;
-    
-    node = (struct apfs_btree_node_phys_t*) bh->b_data;
-    read_b = read_data(node, inode->i_sb, filp, buf, len, ppos);
-    
-    brelse(bh);
-
-    return read_b;        
+    u_int64_t start;
+    ssize_t ret;
+
+    if (iocb->ki_flags & IOCB_NOWAIT)
+        iocb->ki_flags |= IOCB_NOIO;
+
+    start = ktime_get_ns();
+    ret = generic_file_read_iter(iocb, to);
+    apfs_lat_record(file_inode(iocb->ki_filp)->i_sb, APFS_LAT_READ, start);
+
+    return ret;
 }
 
 struct file_operations apfs_file_operations = {
     .owner = THIS_MODULE,
-    .read = apfs_read,
+    .open = apfs_file_open,
+    .read_iter = apfs_file_read_iter,
+    .splice_read = generic_file_splice_read,
     .llseek = generic_file_llseek
 };
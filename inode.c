@@ -17,176 +17,307 @@
 
 #include <linux/fs.h>
 #include <linux/slab.h>
-#include <linux/buffer_head.h>
+#include <linux/sort.h>
+#include <linux/ktime.h>
 
 #include "apfs.h"
 #include "apfs/volume.h"
 
 /*
- * Create and return a new structure with the information of the inode 'i_no'.
+ * Read the target of a symbolic link. It's stored in the
+ * APFS_XATTR_SYMLINK_EA_NAME xattr, including the null character.
  */
-struct inode* get_apfs_inode(struct super_block* sb, struct inode* parent,
-        uint64_t i_no, int inode_type)
+static char* read_symlink_target(struct inode* inode)
 {
-    struct apfs_record_inode_val_t* apfs_inode;
-    struct inode* inode;
-    
-    /*
-     * Get the inode information from the disk.
-     */
-    apfs_inode = get_inode_from_disk(sb, i_no);
-    if (!apfs_inode) {
-        printk(KERN_ERR "apfs: inode not found [%llu]\n",
-                i_no);
+    char* target;
+    int len;
+
+    len = apfs_xattr_get(inode, APFS_XATTR_SYMLINK_EA_NAME, NULL, 0);
+    if (len <= 0)
         return NULL;
-    }
-    
-    /*
-     * Create a new inode structure.
-     */
-    inode = new_inode(sb);
-    if (!inode) {
-        kfree(apfs_inode);
-        printk(KERN_ERR "apfs: inode allocation failed\n");
+
+    target = kmalloc(len + 1, GFP_KERNEL);
+    if (!target)
+        return NULL;
+
+    len = apfs_xattr_get(inode, APFS_XATTR_SYMLINK_EA_NAME, target, len);
+    if (len < 0) {
+        kfree(target);
         return NULL;
     }
+    target[len] = '\0';
 
+    return target;
+}
+
+/*
+ * Fill a new inode with the information of its on-disk record.
+ */
+static int fill_apfs_inode(struct inode* inode, struct inode* parent,
+        struct apfs_record_inode_val_t* apfs_inode, int inode_type)
+{
     /*
-     * Fill the inode structure.
      * TODO:
      * - Set the permissions correctly from the disk data.
      * - Set the uid/gid from the disk data.
-     * - Currently, only files and directories are allowed.
      */
-    inode->i_ino = i_no;
     inode_init_owner(inode, parent, inode_type);
     inc_nlink(inode);
     
     inode->i_ctime.tv_sec = le64_to_cpu(apfs_inode->create_time) / NSEC_TO_SEC;
     inode->i_atime.tv_sec = le64_to_cpu(apfs_inode->access_time) / NSEC_TO_SEC;
     inode->i_mtime.tv_sec = le64_to_cpu(apfs_inode->mod_time) / NSEC_TO_SEC;
-    inode->i_sb = sb;
     inode->i_op = &apfs_inode_operations;
     inode->i_size = get_inode_size(apfs_inode);
     
-    if (inode_type == S_IFDIR)
+    if (inode_type == S_IFDIR) {
         inode->i_fop = &apfs_dir_operations;
-    else
+    } else {
         inode->i_fop = &apfs_file_operations;
+        inode->i_mapping->a_ops = &apfs_aops;
+    }
     
     inode->i_mode |= S_IWUGO | S_IRUGO | S_IXUGO;
 
+    /*
+     * The target of the symbolic links is read now and kept in i_link. In
+     * this way, the path walk can follow the link in RCU mode.
+     */
+    if (inode_type == S_IFLNK) {
+        inode->i_op = &apfs_symlink_inode_operations;
+        inode->i_fop = NULL;
+        inode->i_link = read_symlink_target(inode);
+        if (!inode->i_link) {
+            printk(KERN_ERR "apfs: unable to read the symlink [%lu]\n",
+                    inode->i_ino);
+            return -EIO;
+        }
+        inode->i_size = strlen(inode->i_link);
+    }
+
+    return 0;
+}
+
+/*
+ * Returns the inode 'i_no'. The inodes are kept in the inode cache of the
+ * VFS, so only the first call reads the inode from the disk. The following
+ * calls (and the RCU path walk) find it without doing any I/O. If
+ * 'inode_type' is 0, the type is taken from the mode of the record.
+ */
+struct inode* get_apfs_inode(struct super_block* sb, struct inode* parent,
+        uint64_t i_no, int inode_type)
+{
+    struct apfs_record_inode_val_t* apfs_inode;
+    struct inode* inode;
+    int err;
+    
+    inode = iget_locked(sb, i_no);
+    if (!inode) {
+        printk(KERN_ERR "apfs: inode allocation failed\n");
+        return NULL;
+    }
+
+    if (!(inode->i_state & I_NEW))
+        return inode;
+
+    /*
+     * Get the inode information from the disk.
+     */
+    apfs_inode = get_inode_from_disk(sb, i_no, &APFS_I(inode)->rec_hint);
+    if (!apfs_inode) {
+        printk(KERN_ERR "apfs: inode not found [%llu]\n",
+                i_no);
+        iget_failed(inode);
+        return NULL;
+    }
+
+    if (!inode_type) {
+        inode_type = le16_to_cpu(apfs_inode->mode) & S_IFMT;
+        if (inode_type != S_IFDIR && inode_type != S_IFREG
+                && inode_type != S_IFLNK) {
+            kfree(apfs_inode);
+            iget_failed(inode);
+            return NULL;
+        }
+    }
+
+    err = fill_apfs_inode(inode, parent, apfs_inode, inode_type);
     kfree(apfs_inode);
+    if (err) {
+        iget_failed(inode);
+        return NULL;
+    }
+
+    unlock_new_inode(inode);
         
     return inode;
 }
 
+static int cmp_ino_batch_entries(const void* a, const void* b)
+{
+    const struct apfs_ino_batch_entry* ea = a;
+    const struct apfs_ino_batch_entry* eb = b;
+
+    if (ea->ino < eb->ino)
+        return -1;
+    return ea->ino > eb->ino;
+}
+
 /*
- * This is a recursive function. The records for an object can be distributed
- * in different nodes in the B-Tree. For this reason, the function starts in a
- * node branch. There can be two possibilities:
- *  - It is a non-leaf node: for each record, the function reads the disk 
- *    block and then calls itself.
- *  - It's a leaf node: for each record, the function checks that the record 
- *    type is APFS_TYPE_DIR_REC. Next, check if it's the inode that we searching
- *    and register it.
+ * Read the inodes of a batch of directory entries and add them to the
+ * inode cache. The entries are sorted by inode number and the same cursor
+ * is used for all of them, so the nodes of the path are read only once
+ * and the records that share a leaf node cost a binary search.
  */
-static int search_in_dir(struct apfs_btree_node_phys_t* node,
-        struct super_block* sb, struct inode *parent_inode,
-        struct dentry *child_dentry)
+void apfs_prefetch_inodes(struct inode* dir, struct apfs_ino_batch* batch)
 {
-    struct buffer_head* bh;
-    struct apfs_glb_info* glb_info;
-    struct apfs_record_drec_key_t* drec_key;
-    struct apfs_record_drec_val_t* drec_val;
-    struct apfs_btree_node_phys_t* node_chl;
-    struct apfs_kvloc_t* kvloc;
-    u_int8_t* key_zone;
-    u_int8_t* val_zone;
-    u_int8_t* toc_zone;
-    int ckeys;
-    int entry_type;
-    int rtn_val;
+    struct super_block* sb;
+    struct apfs_btree_cursor cur;
+    struct apfs_record_inode_val_t* apfs_inode;
+    struct apfs_ino_batch_entry* entry;
+    struct inode* inode;
+    void* val;
+    int c, err, len;
 
-    glb_info = (struct apfs_glb_info*) sb->s_fs_info;
+    sb = dir->i_sb;
+    apfs_fstree_cursor_init(&cur, sb);
 
-    toc_zone = get_toc_zone(node);
-    key_zone = get_key_zone(node);
-    val_zone = get_val_zone(sb, node);
-    kvloc = (struct apfs_kvloc_t*) toc_zone;
+    sort(batch->entries, batch->count, sizeof(*batch->entries),
+            cmp_ino_batch_entries, NULL);
 
-    /*
-     * Iterate for over each record of the node
-     */
-    for (ckeys = 0; ckeys<le32_to_cpu(node->btn_nkeys); ckeys++, kvloc++) {
-        /*
-         * If it is not a leaf node, we go to the child node of the tree.
-         */
-        if (le16_to_cpu(node->btn_level) != 0) {
-            bh = get_fstree_child(sb, node, kvloc);
-            if (!bh)
-                continue;
-            node_chl = (struct apfs_btree_node_phys_t*) bh->b_data;        
-            rtn_val = search_in_dir(node_chl, sb, parent_inode, child_dentry); 
-            
-            brelse(bh);
-            
-            if (rtn_val)
-                return rtn_val;
-            else
-                continue;
+    for (c = 0; c < batch->count; c++) {
+        entry = &batch->entries[c];
+
+        inode = iget_locked(sb, entry->ino);
+        if (!inode)
+            break;
+        if (!(inode->i_state & I_NEW)) {
+            iput(inode);
+            continue;
         }
-        
+
+        apfs_inode = NULL;
+        apfs_btree_cursor_hint(&cur, &APFS_I(inode)->rec_hint);
+        err = apfs_btree_seek(&cur, entry->ino, APFS_TYPE_INODE, 0);
+        if (err == 0) {
+            val = apfs_btree_val(&cur, &len);
+            apfs_inode = copy_inode_val(val, len);
+        }
+        if (!apfs_inode) {
+            iget_failed(inode);
+            if (err < 0)
+                break;
+            continue;
+        }
+
+        err = fill_apfs_inode(inode, dir, apfs_inode, entry->mode);
+        kfree(apfs_inode);
+        if (err) {
+            iget_failed(inode);
+            continue;
+        }
+
         /*
-         * It's a leaf node, we look for the directory entries.
+         * The inode stays in the inode cache after the last iput.
          */
-        drec_key = (struct apfs_record_drec_key_t*) (key_zone + le16_to_cpu(kvloc->k.off));
-        drec_val = (struct apfs_record_drec_val_t*) (val_zone - le16_to_cpu(kvloc->v.off));
+        unlock_new_inode(inode);
+        iput(inode);
+    }
+
+    apfs_btree_cursor_release(&cur);
+    batch->count = 0;
+}
+
+/*
+ * Search the directory entry of 'child_dentry' in the records of the parent
+ * directory. Returns the inode of the entry, NULL if it isn't found or an
+ * error pointer.
+ */
+static struct inode* search_in_dir(struct super_block* sb,
+        struct inode *parent_inode, struct dentry *child_dentry)
+{
+    struct apfs_btree_cursor cur;
+    struct apfs_record_drec_key_t* drec_key;
+    struct apfs_record_drec_val_t* drec_val;
+    struct inode* inode;
+    int entry_type;
+    int len;
+    int ret;
+
+    inode = NULL;
+    apfs_fstree_cursor_init(&cur, sb);
+    apfs_btree_cursor_hint(&cur, &APFS_I(parent_inode)->data_hint);
+
+    for (ret = apfs_btree_range_first(&cur, parent_inode->i_ino,
+                APFS_TYPE_DIR_REC);
+            ret > 0; ret = apfs_btree_range_next(&cur)) {
+        drec_key = (struct apfs_record_drec_key_t*) apfs_btree_key(&cur, &len);
+        drec_val = (struct apfs_record_drec_val_t*) apfs_btree_val(&cur, &len);
         
-        if (get_fs_obj_id(&(drec_key->hdr)) == parent_inode->i_ino 
-                && get_fs_obj_type(&(drec_key->hdr)) == APFS_TYPE_DIR_REC) {
-            if (!strcmp(child_dentry->d_name.name, 
-                        normalize_string(drec_key->name))){
-                if (le16_to_cpu(drec_val->flags) & APFS_DT_DIR)
-                    entry_type = S_IFDIR;
-                else if (le16_to_cpu(drec_val->flags) & APFS_DT_REG)
-                    entry_type = S_IFREG;
-                else 
-                    continue;
-                d_add(child_dentry, get_apfs_inode(sb, parent_inode, 
-                            le64_to_cpu(drec_val->file_id), entry_type));
-                return 1;
-            } 
+        if (apfs_name_cmp(sb, child_dentry->d_name.name,
+                    child_dentry->d_name.len,
+                    normalize_string(drec_key->name)))
+            continue;
+
+        switch (le16_to_cpu(drec_val->flags) & APFS_DREC_TYPE_MASK) {
+        case APFS_DT_DIR:
+            entry_type = S_IFDIR;
+            break;
+        case APFS_DT_REG:
+            entry_type = S_IFREG;
+            break;
+        case APFS_DT_LNK:
+            entry_type = S_IFLNK;
+            break;
+        default:
+            continue;
         }
+        inode = get_apfs_inode(sb, parent_inode, 
+                le64_to_cpu(drec_val->file_id), entry_type);
+        if (!inode)
+            inode = ERR_PTR(-EIO);
+        break;
     }
+
+    apfs_btree_cursor_release(&cur);
+    if (ret < 0)
+        return ERR_PTR(ret);
     
-    return 0;
+    return inode;
 } 
 
+/*
+ * The names that are not found get a negative dentry, so the next lookups
+ * of the name don't search the directory again. The directories with a
+ * Bloom filter answer most of the misses without reading the B-Tree.
+ */
 static struct dentry *apfs_lookup(struct inode *parent_inode,
         struct dentry *child_dentry, unsigned int flags)
 {
-    struct super_block* sb;
-    struct buffer_head* bh;
-    struct apfs_btree_node_phys_t* node;
-    
-    sb = parent_inode->i_sb;
-    bh = get_inode_branch(sb, parent_inode->i_ino);
-    if (!bh) {
-        printk(KERN_INFO "apfs: inode not found[%lu]\n",
-                parent_inode->i_ino);
-        return NULL;
-    }
-
-    node = (struct apfs_btree_node_phys_t*) bh->b_data;
-    search_in_dir(node, sb, parent_inode, child_dentry);
+    struct dentry* dentry;
+    struct inode* inode;
+    u_int64_t start;
     
-    brelse(bh);
+    start = ktime_get_ns();
+    inode = NULL;
+    if (apfs_dir_may_contain(parent_inode, &child_dentry->d_name))
+        inode = search_in_dir(parent_inode->i_sb, parent_inode, child_dentry);
+    if (IS_ERR(inode))
+        dentry = ERR_CAST(inode);
+    else
+        dentry = d_splice_alias(inode, child_dentry);
+    apfs_lat_record(parent_inode->i_sb, APFS_LAT_LOOKUP, start);
 
-    return NULL;
+    return dentry;
 }
 
 struct inode_operations apfs_inode_operations = {
-    .lookup = apfs_lookup
+    .lookup = apfs_lookup,
+    .listxattr = apfs_listxattr
+};
+
+struct inode_operations apfs_symlink_inode_operations = {
+    .get_link = simple_get_link,
+    .listxattr = apfs_listxattr
 };
 
@@ -0,0 +1,170 @@
+/*
+ * This file is part of the APFS-Module.
+ * Copyright (c) 2019 Jordi Barcons.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <linux/fs.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/slab.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+
+#include "apfs.h"
+
+/*
+ * Read 'size' bytes from the byte 'pos' of the device to the pages of the
+ * buffer with a single bio. 'op_flags' are added to REQ_OP_READ.
+ */
+static int read_pages(struct super_block* sb, struct page* page,
+        u_int64_t pos, unsigned int size, unsigned int op_flags)
+{
+    struct bio* bio;
+    unsigned int len;
+    int err;
+
+    bio = bio_alloc(GFP_NOFS, DIV_ROUND_UP(size, PAGE_SIZE));
+    bio_set_dev(bio, sb->s_bdev);
+    bio->bi_iter.bi_sector = pos >> SECTOR_SHIFT;
+    bio->bi_opf = REQ_OP_READ | op_flags;
+
+    for (; size; size -= len, page++) {
+        len = min_t(unsigned int, size, PAGE_SIZE);
+        if (bio_add_page(bio, page, len, 0) != len) {
+            bio_put(bio);
+            return -EIO;
+        }
+    }
+
+    err = submit_bio_wait(bio);
+    bio_put(bio);
+
+    return err;
+}
+
+/*
+ * Read 'size' bytes starting at the block 'paddr' (in units of 'size').
+ */
+static struct apfs_buf* read_buf(struct super_block* sb, paddr_t paddr,
+        unsigned int size)
+{
+    struct apfs_buf* buf;
+
+    buf = kmalloc(sizeof(*buf), GFP_NOFS);
+    if (!buf)
+        return NULL;
+
+    buf->order = get_order(size);
+    buf->page = alloc_pages(GFP_NOFS, buf->order);
+    if (!buf->page) {
+        kfree(buf);
+        return NULL;
+    }
+
+    if (read_pages(sb, buf->page, paddr * size, size, REQ_META | REQ_SYNC)) {
+        printk(KERN_ERR "apfs: unable to read block [%llu]\n", paddr);
+        __free_pages(buf->page, buf->order);
+        kfree(buf);
+        return NULL;
+    }
+
+    buf->paddr = paddr;
+    buf->data = page_address(buf->page);
+
+    return buf;
+}
+
+/*
+ * Read the block 'paddr' of the container. The block is read with a bio
+ * into its own pages, so block sizes bigger than a page don't need the
+ * buffer cache. Returns NULL on failure.
+ */
+struct apfs_buf* apfs_read_block(struct super_block* sb, paddr_t paddr)
+{
+    return read_buf(sb, paddr, sb->s_blocksize);
+}
+
+/*
+ * Read the container superblock. The block size is not known yet, so only
+ * the first APFS_DEFAULT_BLOCK_SIZE bytes are read, which hold the whole
+ * structure.
+ */
+struct apfs_buf* apfs_read_super_block(struct super_block* sb)
+{
+    return read_buf(sb, APFS_SUPERBLOCK_BLOCK, APFS_DEFAULT_BLOCK_SIZE);
+}
+
+/*
+ * Completion of the readahead bios. The part of the last page beyond the
+ * end of the file is zeroed.
+ */
+static void data_read_end_io(struct bio* bio)
+{
+    struct bio_vec* bvec;
+    struct bvec_iter_all iter_all;
+    struct page* page;
+    loff_t size;
+
+    bio_for_each_segment_all(bvec, bio, iter_all) {
+        page = bvec->bv_page;
+        if (bio->bi_status) {
+            SetPageError(page);
+        } else {
+            size = i_size_read(page->mapping->host);
+            if (size - page_offset(page) < PAGE_SIZE)
+                zero_user_segment(page, size - page_offset(page), PAGE_SIZE);
+            SetPageUptodate(page);
+        }
+        unlock_page(page);
+    }
+
+    bio_put(bio);
+}
+
+/*
+ * Returns a readahead bio for up to 'nr_pages' pages of file data from the
+ * byte 'pos' of the device. The pages are unlocked when the read finishes.
+ */
+struct bio* apfs_data_bio_alloc(struct super_block* sb, u_int64_t pos,
+        unsigned int nr_pages)
+{
+    struct bio* bio;
+
+    bio = bio_alloc(GFP_NOFS, min_t(unsigned int, nr_pages, BIO_MAX_PAGES));
+    bio_set_dev(bio, sb->s_bdev);
+    bio->bi_iter.bi_sector = pos >> SECTOR_SHIFT;
+    bio->bi_opf = REQ_OP_READ | REQ_RAHEAD;
+    bio->bi_end_io = data_read_end_io;
+
+    return bio;
+}
+
+/*
+ * Read a page of file data from the byte 'pos' of the device.
+ */
+int apfs_read_data_page(struct super_block* sb, struct page* page,
+        u_int64_t pos)
+{
+    return read_pages(sb, page, pos, PAGE_SIZE, REQ_SYNC);
+}
+
+void apfs_release_block(struct apfs_buf* buf)
+{
+    if (!buf)
+        return;
+
+    __free_pages(buf->page, buf->order);
+    kfree(buf);
+}
@@ -0,0 +1,359 @@
+/*
+ * This file is part of the APFS-Module.
+ * Copyright (c) 2019 Jordi Barcons.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/uaccess.h>
+#include <linux/capability.h>
+
+#include "apfs.h"
+#include "apfs/volume.h"
+#include "apfs/ioctl.h"
+
+/*
+ * Directories whose membership in the subtree is known. The ancestors of
+ * most inodes are the same few directories, so a small direct-mapped cache
+ * avoids walking the parents of each inode.
+ */
+#define APFS_SUBTREE_CACHE_BITS 8
+#define APFS_SUBTREE_MAX_DEPTH  64
+
+struct subtree_cache {
+    u_int64_t ino[1 << APFS_SUBTREE_CACHE_BITS];
+    bool in[1 << APFS_SUBTREE_CACHE_BITS];
+};
+
+/*
+ * Fill 'st' from the inode record in the current position of the cursor.
+ */
+static int fill_bulkstat(struct apfs_btree_cursor* cur, u_int64_t ino,
+        struct apfs_bulkstat* st)
+{
+    struct apfs_record_inode_val_t* apfs_inode;
+    void* val;
+    int len;
+
+    val = apfs_btree_val(cur, &len);
+    apfs_inode = copy_inode_val(val, len);
+    if (!apfs_inode)
+        return -EIO;
+
+    memset(st, 0, sizeof(*st));
+    st->ino = ino;
+    st->parent = le64_to_cpu(apfs_inode->parent_id);
+    st->size = get_inode_size(apfs_inode);
+    st->crtime = le64_to_cpu(apfs_inode->create_time);
+    st->mtime = le64_to_cpu(apfs_inode->mod_time);
+    st->ctime = le64_to_cpu(apfs_inode->change_time);
+    st->atime = le64_to_cpu(apfs_inode->access_time);
+    st->mode = le16_to_cpu(apfs_inode->mode);
+    st->nlink = le32_to_cpu(apfs_inode->nlink);
+    kfree(apfs_inode);
+
+    return 0;
+}
+
+/*
+ * Returns the parent of the inode 'ino', 0 if it doesn't exist.
+ */
+static int read_parent(struct apfs_btree_cursor* cur, u_int64_t ino,
+        u_int64_t* parent)
+{
+    struct apfs_record_inode_val_t* apfs_inode;
+    void* val;
+    int len;
+    int ret;
+
+    *parent = 0;
+    ret = apfs_btree_seek(cur, ino, APFS_TYPE_INODE, 0);
+    if (ret < 0)
+        return ret;
+    if (ret > 0)
+        return 0;
+
+    val = apfs_btree_val(cur, &len);
+    if (len < sizeof(*apfs_inode))
+        return -EIO;
+    apfs_inode = (struct apfs_record_inode_val_t*) val;
+    *parent = le64_to_cpu(apfs_inode->parent_id);
+
+    return 0;
+}
+
+/*
+ * Returns 1 if the directory 'dir' is 'root' or one of its descendants, 0
+ * if it isn't or a negative error. The verdict is saved for all the
+ * directories of the path walked.
+ */
+static int in_subtree(struct apfs_btree_cursor* cur,
+        struct subtree_cache* cache, u_int64_t root, u_int64_t dir)
+{
+    u_int64_t path[APFS_SUBTREE_MAX_DEPTH];
+    u_int32_t slot;
+    int depth, c, ret;
+
+    for (depth = 0; ; depth++) {
+        if (dir == root) {
+            ret = 1;
+            break;
+        }
+        if (dir < ROOT_DIR_INO_NUM || depth == APFS_SUBTREE_MAX_DEPTH) {
+            ret = 0;
+            break;
+        }
+
+        slot = hash_64(dir, APFS_SUBTREE_CACHE_BITS);
+        if (cache->ino[slot] == dir) {
+            ret = cache->in[slot];
+            break;
+        }
+
+        path[depth] = dir;
+        ret = read_parent(cur, dir, &dir);
+        if (ret < 0)
+            return ret;
+    }
+
+    for (c = 0; c < depth; c++) {
+        slot = hash_64(path[c], APFS_SUBTREE_CACHE_BITS);
+        cache->ino[slot] = path[c];
+        cache->in[slot] = ret;
+    }
+
+    return ret;
+}
+
+/*
+ * Return the inodes below the directory, walking all the inode records of
+ * the volume in the order of the B-Tree. The cookie is the next inode
+ * number to scan.
+ */
+static int bulkstat_subtree(struct inode* dir, struct apfs_bulkstat_req* req,
+        struct apfs_bulkstat __user* ubuf)
+{
+    struct apfs_btree_cursor cur;
+    struct apfs_btree_cursor parent_cur;
+    struct subtree_cache* cache;
+    struct apfs_bulkstat st;
+    u_int64_t oid;
+    u_int8_t type;
+    int ret, in;
+
+    cache = kzalloc(sizeof(*cache), GFP_KERNEL);
+    if (!cache)
+        return -ENOMEM;
+
+    apfs_fstree_cursor_init(&cur, dir->i_sb);
+    apfs_fstree_cursor_init(&parent_cur, dir->i_sb);
+
+    oid = req->cookie;
+    ret = apfs_btree_seek_ge(&cur, oid, APFS_TYPE_INODE, 0);
+    while (ret > 0) {
+        apfs_btree_key_id(&cur, &oid, &type);
+
+        /*
+         * Skip the rest of records of the object, or go to its inode
+         * record if the cursor is before it.
+         */
+        if (type != APFS_TYPE_INODE) {
+            ret = apfs_btree_seek_ge(&cur, type < APFS_TYPE_INODE ? oid
+                    : oid + 1, APFS_TYPE_INODE, 0);
+            continue;
+        }
+
+        ret = fill_bulkstat(&cur, oid, &st);
+        if (ret)
+            break;
+
+        in = in_subtree(&parent_cur, cache, dir->i_ino, st.parent);
+        if (in < 0) {
+            ret = in;
+            break;
+        }
+
+        if (in) {
+            if (req->count == req->buf_count) {
+                req->cookie = oid;
+                ret = 1;
+                break;
+            }
+            if (copy_to_user(&ubuf[req->count], &st, sizeof(st))) {
+                ret = -EFAULT;
+                break;
+            }
+            req->count++;
+        }
+
+        ret = apfs_btree_next(&cur);
+    }
+
+    apfs_btree_cursor_release(&parent_cur);
+    apfs_btree_cursor_release(&cur);
+    kfree(cache);
+
+    /*
+     * The scan is done only when the B-Tree ran out of records, not when
+     * the buffer was filled.
+     */
+    if (ret == 0)
+        req->done = 1;
+
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Return the children of the directory in the order of its directory
+ * records. The cookie is the position of the next entry, as in readdir.
+ */
+static int bulkstat_children(struct inode* dir, struct apfs_bulkstat_req* req,
+        struct apfs_bulkstat __user* ubuf)
+{
+    struct apfs_btree_cursor cur;
+    struct apfs_btree_cursor ino_cur;
+    struct apfs_record_drec_hashed_key_t* drec_key;
+    struct apfs_record_drec_val_t* drec_val;
+    struct apfs_bulkstat st;
+    u_int32_t start_hash;
+    u_int32_t hash;
+    u_int32_t prev_hash;
+    unsigned int skip;
+    unsigned int dup;
+    u_int64_t ino;
+    int len;
+    int ret;
+
+    start_hash = 0;
+    skip = 0;
+    if (req->cookie >= APFS_DIR_POS_EOF) {
+        req->done = 1;
+        return 0;
+    }
+    if (req->cookie >= APFS_DIR_POS_FIRST) {
+        start_hash = (req->cookie - APFS_DIR_POS_FIRST)
+            >> APFS_DIR_POS_DUP_BITS;
+        skip = (req->cookie - APFS_DIR_POS_FIRST) & APFS_DIR_POS_DUP_MAX;
+    }
+
+    apfs_fstree_cursor_init(&cur, dir->i_sb);
+    apfs_btree_cursor_hint(&cur, &APFS_I(dir)->data_hint);
+    apfs_fstree_cursor_init(&ino_cur, dir->i_sb);
+
+    dup = 0;
+    prev_hash = U32_MAX;
+    for (ret = apfs_btree_range_from(&cur, dir->i_ino, APFS_TYPE_DIR_REC,
+                start_hash << APFS_DREC_HASH_SHIFT);
+            ret > 0; ret = apfs_btree_range_next(&cur)) {
+        drec_key = (struct apfs_record_drec_hashed_key_t*)
+            apfs_btree_key(&cur, &len);
+        drec_val = (struct apfs_record_drec_val_t*) apfs_btree_val(&cur, &len);
+
+        hash = (le32_to_cpu(drec_key->name_len_and_hash)
+                & APFS_DREC_HASH_MASK) >> APFS_DREC_HASH_SHIFT;
+        dup = hash == prev_hash ? dup + 1 : 0;
+        prev_hash = hash;
+        if (hash == start_hash && dup < skip)
+            continue;
+
+        if (req->count == req->buf_count) {
+            req->cookie = apfs_drec_pos(hash, dup);
+            ret = 1;
+            break;
+        }
+
+        ino = le64_to_cpu(drec_val->file_id);
+        ret = apfs_btree_seek(&ino_cur, ino, APFS_TYPE_INODE, 0);
+        if (ret < 0)
+            break;
+        if (ret > 0)
+            continue;
+
+        ret = fill_bulkstat(&ino_cur, ino, &st);
+        if (ret)
+            break;
+        if (copy_to_user(&ubuf[req->count], &st, sizeof(st))) {
+            ret = -EFAULT;
+            break;
+        }
+        req->count++;
+    }
+
+    apfs_btree_cursor_release(&ino_cur);
+    apfs_btree_cursor_release(&cur);
+
+    if (ret == 0) {
+        req->cookie = APFS_DIR_POS_EOF;
+        req->done = 1;
+    }
+
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Return the attributes of many inodes in a single call. The records are
+ * read directly from the B-Tree, without creating inodes or dentries.
+ */
+static long apfs_ioc_bulkstat(struct file* filp, void __user* arg)
+{
+    struct apfs_bulkstat_req req;
+    struct inode* dir;
+    int err;
+
+    if (copy_from_user(&req, arg, sizeof(req)))
+        return -EFAULT;
+    if (req.flags & ~APFS_BULKSTAT_SUBTREE)
+        return -EINVAL;
+
+    /*
+     * The subtree scan returns inodes below directories that the caller
+     * may not be allowed to search, so it's only for the administrator.
+     * Listing the children needs the same permissions as readdir+stat.
+     */
+    dir = file_inode(filp);
+    if (req.flags & APFS_BULKSTAT_SUBTREE) {
+        if (!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+    } else {
+        err = inode_permission(dir, MAY_READ | MAY_EXEC);
+        if (err)
+            return err;
+    }
+    req.count = 0;
+    req.done = 0;
+
+    if (req.flags & APFS_BULKSTAT_SUBTREE)
+        err = bulkstat_subtree(dir, &req, u64_to_user_ptr(req.buf));
+    else
+        err = bulkstat_children(dir, &req, u64_to_user_ptr(req.buf));
+    if (err)
+        return err;
+
+    if (copy_to_user(arg, &req, sizeof(req)))
+        return -EFAULT;
+
+    return 0;
+}
+
+long apfs_dir_ioctl(struct file* filp, unsigned int cmd, unsigned long arg)
+{
+    switch (cmd) {
+    case APFS_IOC_BULKSTAT:
+        return apfs_ioc_bulkstat(filp, (void __user*) arg);
+    default:
+        return -ENOTTY;
+    }
+}
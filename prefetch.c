@@ -0,0 +1,213 @@
+/*
+ * This file is part of the APFS-Module.
+ * Copyright (c) 2019 Jordi Barcons.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/pagemap.h>
+#include <linux/workqueue.h>
+
+#include "apfs.h"
+
+/*
+ * The files of a directory opened one after another in the order of the
+ * listing (tar, rsync, backups) are detected with the listing cache of the
+ * directory. Once APFS_SEQ_MIN_HITS files were opened in order, the inodes,
+ * the first extents and the first pages of the next APFS_SEQ_FILES files
+ * are read by a worker, so the next open finds them in memory.
+ */
+#define APFS_SEQ_MIN_HITS       2
+#define APFS_SEQ_FILES          4
+#define APFS_SEQ_WINDOW         8       /* Entries searched after the last */
+#define APFS_SEQ_SCAN_MAX       4096    /* Listings searched in full */
+#define APFS_SEQ_PAGES          32      /* First pages read of each file */
+
+struct apfs_prefetch_work {
+    struct work_struct work;
+    struct inode* dir;
+    struct apfs_ino_batch batch;
+};
+
+/*
+ * Read the first pages of a file. The extent lookup also leaves the leaf of
+ * the first extent in the hint of the inode.
+ */
+static void prefetch_data(struct inode* inode)
+{
+    struct file_ra_state ra;
+    unsigned long nr;
+
+    nr = min_t(unsigned long, APFS_SEQ_PAGES,
+            DIV_ROUND_UP(i_size_read(inode), PAGE_SIZE));
+    if (!nr)
+        return;
+
+    file_ra_state_init(&ra, inode->i_mapping);
+    page_cache_sync_readahead(inode->i_mapping, &ra, NULL, 0, nr);
+}
+
+static void prefetch_work(struct work_struct* work)
+{
+    struct apfs_prefetch_work* pw;
+    struct inode* inode;
+    u_int64_t inos[APFS_SEQ_FILES];
+    int count, c;
+
+    pw = container_of(work, struct apfs_prefetch_work, work);
+
+    /*
+     * apfs_prefetch_inodes() sorts and empties the batch.
+     */
+    count = pw->batch.count;
+    for (c = 0; c < count; c++)
+        inos[c] = pw->batch.entries[c].ino;
+    apfs_prefetch_inodes(pw->dir, &pw->batch);
+
+    for (c = 0; c < count; c++) {
+        inode = ilookup(pw->dir->i_sb, inos[c]);
+        if (!inode)
+            continue;
+        prefetch_data(inode);
+        iput(inode);
+    }
+
+    iput(pw->dir);
+    kfree(pw);
+}
+
+/*
+ * Returns the position of the inode 'ino' in the cached listing, or -1.
+ * The entries after the last file opened are searched first.
+ */
+static int find_in_listing(struct apfs_dir_cache* cache, int last,
+        u_int64_t ino)
+{
+    int c, end;
+
+    end = min_t(int, cache->count, last + 1 + APFS_SEQ_WINDOW);
+    for (c = last + 1; c < end; c++)
+        if (cache->entries[c].ino == ino)
+            return c;
+
+    if (cache->count > APFS_SEQ_SCAN_MAX)
+        return -1;
+
+    for (c = 0; c < cache->count; c++)
+        if (cache->entries[c].ino == ino)
+            return c;
+
+    return -1;
+}
+
+/*
+ * Queue the prefetch of the regular files that follow the position 'pos'
+ * of the listing, skipping the ones already queued. Called with the lock
+ * of the sequence held.
+ */
+static void queue_prefetch(struct inode* dir, struct apfs_dir_cache* cache,
+        int pos)
+{
+    struct apfs_glb_info* glb_info;
+    struct apfs_seq_state* seq;
+    struct apfs_prefetch_work* pw;
+    struct apfs_dirent* e;
+    int c;
+
+    glb_info = (struct apfs_glb_info*) dir->i_sb->s_fs_info;
+    seq = &APFS_I(dir)->seq;
+
+    c = max(pos, seq->queued) + 1;
+    if (c >= cache->count || c > pos + APFS_SEQ_FILES)
+        return;
+
+    pw = kmalloc(sizeof(*pw), GFP_ATOMIC);
+    if (!pw)
+        return;
+    pw->batch.count = 0;
+
+    for (; c < cache->count && pw->batch.count < APFS_SEQ_FILES; c++) {
+        e = &cache->entries[c];
+        if (e->type != DT_REG)
+            continue;
+        pw->batch.entries[pw->batch.count].ino = e->ino;
+        pw->batch.entries[pw->batch.count].mode = S_IFREG;
+        pw->batch.count++;
+    }
+    seq->queued = c - 1;
+
+    if (!pw->batch.count) {
+        kfree(pw);
+        return;
+    }
+
+    pw->dir = igrab(dir);
+    if (!pw->dir) {
+        kfree(pw);
+        return;
+    }
+    INIT_WORK(&pw->work, prefetch_work);
+    queue_work(glb_info->prefetch_wq, &pw->work);
+}
+
+/*
+ * Called when a regular file is opened. If the files of its directory are
+ * being opened in the order of the listing, the next files are prefetched.
+ */
+void apfs_seq_open(struct file* filp)
+{
+    struct apfs_glb_info* glb_info;
+    struct apfs_inode_info* ai;
+    struct apfs_dir_cache* cache;
+    struct apfs_seq_state* seq;
+    struct dentry* parent;
+    struct inode* dir;
+    int pos;
+
+    glb_info = (struct apfs_glb_info*) file_inode(filp)->i_sb->s_fs_info;
+    if (!glb_info->prefetch_wq)
+        return;
+
+    parent = dget_parent(filp->f_path.dentry);
+    dir = d_inode(parent);
+    ai = APFS_I(dir);
+    seq = &ai->seq;
+
+    rcu_read_lock();
+    cache = rcu_dereference(ai->dir_cache);
+    if (!cache)
+        goto out;
+
+    spin_lock(&seq->lock);
+    pos = find_in_listing(cache, seq->last, file_inode(filp)->i_ino);
+    if (pos < 0) {
+        seq->hits = 0;
+    } else {
+        if (pos > seq->last && pos <= seq->last + APFS_SEQ_WINDOW)
+            seq->hits++;
+        else
+            seq->hits = 0;
+        if (pos < seq->last)
+            seq->queued = pos;
+        seq->last = pos;
+        if (seq->hits >= APFS_SEQ_MIN_HITS)
+            queue_prefetch(dir, cache, pos);
+    }
+    spin_unlock(&seq->lock);
+
+out:
+    rcu_read_unlock();
+    dput(parent);
+}
@@ -0,0 +1,150 @@
+/*
+ * This file is part of the APFS-Module.
+ * Copyright (c) 2019 Jordi Barcons.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <linux/fs.h>
+#include <linux/kernel.h>
+
+#include "apfs.h"
+#include "apfs/btree.h"
+#include "apfs/volume.h"
+#include "apfs/omap.h"
+
+/*
+ * Look for the snapshot 'xid' in the omap snapshot tree. Its keys are xids
+ * and its values apfs_omap_snapshot_t, both of fixed size. Returns 0 if
+ * the snapshot exists and it's not deleted. The omap of a volume without
+ * snapshots has no snapshot tree.
+ */
+static int check_omap_snapshot(struct super_block* sb, paddr_t tree,
+        xid_t xid)
+{
+    struct apfs_omap_snapshot_t* snap;
+    struct apfs_node* node;
+    struct apfs_kvoff_t* kvoff;
+    u_int64_t* key;
+    int left, right, mid, found;
+    int depth, err;
+
+    if (!tree)
+        return -ENOENT;
+
+    for (depth = 0; depth < APFS_BTREE_MAX_DEPTH; depth++) {
+        node = apfs_node_get(sb, tree);
+        if (!node)
+            return -EIO;
+
+        left = 0;
+        right = node->nkeys - 1;
+        found = -1;
+        while (left <= right) {
+            mid = left + (right - left) / 2;
+            kvoff = (struct apfs_kvoff_t*) node->toc + mid;
+            key = (u_int64_t*) (node->keys + le16_to_cpu(kvoff->k));
+            if (le64_to_cpu(*key) <= xid) {
+                found = mid;
+                left = mid + 1;
+            } else {
+                right = mid - 1;
+            }
+        }
+
+        if (found < 0) {
+            apfs_node_put(node);
+            return -ENOENT;
+        }
+
+        kvoff = (struct apfs_kvoff_t*) node->toc + found;
+        if (node->level == 0) {
+            key = (u_int64_t*) (node->keys + le16_to_cpu(kvoff->k));
+            snap = (struct apfs_omap_snapshot_t*)
+                (node->vals - le16_to_cpu(kvoff->v));
+            err = 0;
+            if (le64_to_cpu(*key) != xid
+                    || le32_to_cpu(snap->oms_flags) & APFS_OMAP_SNAPSHOT_DELETED)
+                err = -ENOENT;
+            apfs_node_put(node);
+            return err;
+        }
+
+        tree = le64_to_cpu(*(u_int64_t*) (node->vals - le16_to_cpu(kvoff->v)));
+        apfs_node_put(node);
+    }
+
+    return -EIO;
+}
+
+/*
+ * Look for the snapshot 'name' of the volume. Its APFS_TYPE_SNAP_NAME
+ * record gives the xid of the snapshot, and the APFS_TYPE_SNAP_METADATA
+ * record of this xid the physical address of the volume superblock of the
+ * snapshot. The snapshot must also be in the omap snapshot tree, as the
+ * omap only keeps the old versions of the objects for these xids.
+ */
+int apfs_find_snapshot(struct super_block* sb,
+        struct apfs_vol_superblock_t* apfs_vol, paddr_t omap_snap_tree,
+        const char* name, xid_t* xid, paddr_t* sblock)
+{
+    struct apfs_btree_cursor cur;
+    struct apfs_record_snap_name_key_t* name_key;
+    struct apfs_record_snap_name_val_t* name_val;
+    struct apfs_record_snap_metadata_val_t* meta_val;
+    size_t name_len;
+    int len;
+    int ret;
+
+    *xid = 0;
+    name_len = strlen(name) + 1;
+    apfs_btree_cursor_init(&cur, sb,
+            le64_to_cpu(apfs_vol->apfs_snap_meta_tree_oid), 0, 0);
+
+    for (ret = apfs_btree_range_first(&cur, APFS_SNAP_NAME_OBJ_ID,
+                APFS_TYPE_SNAP_NAME);
+            ret > 0; ret = apfs_btree_range_next(&cur)) {
+        name_key = (struct apfs_record_snap_name_key_t*)
+            apfs_btree_key(&cur, &len);
+        if (le16_to_cpu(name_key->name_len) != name_len
+                || memcmp(name_key->name, name, name_len))
+            continue;
+
+        name_val = (struct apfs_record_snap_name_val_t*)
+            apfs_btree_val(&cur, &len);
+        *xid = le64_to_cpu(name_val->snap_xid);
+        break;
+    }
+    if (ret <= 0) {
+        ret = ret ? ret : -ENOENT;
+        goto out;
+    }
+
+    ret = apfs_btree_seek(&cur, *xid, APFS_TYPE_SNAP_METADATA, 0);
+    if (ret) {
+        ret = ret < 0 ? ret : -EIO;
+        goto out;
+    }
+    meta_val = (struct apfs_record_snap_metadata_val_t*)
+        apfs_btree_val(&cur, &len);
+    *sblock = le64_to_cpu(meta_val->sblock_oid);
+
+    ret = check_omap_snapshot(sb, omap_snap_tree, *xid);
+
+out:
+    apfs_btree_cursor_release(&cur);
+    if (ret == -ENOENT)
+        printk(KERN_ERR "apfs: snapshot [%s] not found\n", name);
+
+    return ret;
+}
@@ -20,7 +20,11 @@
 #include <linux/fs.h>
 #include <linux/kernel.h>
 #include <linux/slab.h>
-#include <linux/buffer_head.h>
+#include <linux/parser.h>
+#include <linux/blkdev.h>
+#include <linux/backing-dev.h>
+#include <linux/statfs.h>
+#include <asm/unaligned.h>
 
 #include "apfs.h"
 #include "apfs/container.h"
@@ -28,132 +32,390 @@
 #include "apfs/btree.h"
 #include "apfs/omap.h"
 
+static struct kmem_cache* apfs_inode_cachep;
+
+static struct inode* apfs_alloc_inode(struct super_block* sb)
+{
+    struct apfs_inode_info* ai;
+
+    ai = kmem_cache_alloc(apfs_inode_cachep, GFP_KERNEL);
+    if (!ai)
+        return NULL;
+
+    RCU_INIT_POINTER(ai->xattrs, NULL);
+    RCU_INIT_POINTER(ai->dir_bloom, NULL);
+    RCU_INIT_POINTER(ai->dir_cache, NULL);
+    memset(&ai->rec_hint, 0, sizeof(ai->rec_hint));
+    memset(&ai->data_hint, 0, sizeof(ai->data_hint));
+    memset(ai->ext, 0, sizeof(ai->ext));
+    ai->seq.last = -1;
+    ai->seq.hits = 0;
+    ai->seq.queued = -1;
+    ai->flags = 0;
+
+    return &ai->vfs_inode;
+}
+
+/*
+ * The xattrs and the directory listings are released before the RCU grace
+ * period of the inode, as their LRU lists can't be locked from the RCU
+ * callback.
+ */
+static void apfs_destroy_inode(struct inode* inode)
+{
+    apfs_drop_xattrs(inode);
+    apfs_drop_dir_cache(inode);
+}
+
+static void apfs_free_inode(struct inode* inode)
+{
+    if (S_ISLNK(inode->i_mode))
+        kfree(inode->i_link);
+    kfree(rcu_access_pointer(APFS_I(inode)->dir_bloom));
+    kmem_cache_free(apfs_inode_cachep, APFS_I(inode));
+}
+
+static void apfs_inode_init_once(void* p)
+{
+    struct apfs_inode_info* ai;
+
+    ai = (struct apfs_inode_info*) p;
+    mutex_init(&ai->xattr_lock);
+    INIT_LIST_HEAD(&ai->xattr_lru);
+    INIT_LIST_HEAD(&ai->dir_lru);
+    spin_lock_init(&ai->seq.lock);
+    spin_lock_init(&ai->ext_lock);
+    inode_init_once(&ai->vfs_inode);
+}
+
+/*
+ * The caches are released in apfs_kill_sb(), as they also exist for the
+ * volumes that failed to mount.
+ */
 static void apfs_put_super(struct super_block* sb)
 {
-    kfree(sb->s_fs_info);
+    struct apfs_glb_info* glb_info;
+
+    glb_info = (struct apfs_glb_info*) sb->s_fs_info;
+    apfs_unregister_shrinker(glb_info);
     printk(KERN_INFO "apfs: super putted!\n");
 }
 
+/*
+ * The volumes of a container share its free space, so the free blocks are
+ * the ones of the container, limited by the quota of the volume. The files
+ * can use any free block.
+ */
+static int apfs_statfs(struct dentry* dentry, struct kstatfs* buf)
+{
+    struct super_block* sb;
+    struct apfs_glb_info* glb_info;
+    u_int64_t free;
+    int err;
+
+    sb = dentry->d_sb;
+    glb_info = (struct apfs_glb_info*) sb->s_fs_info;
+
+    err = apfs_container_free_blocks(sb, &free);
+    if (err)
+        return err;
+
+    buf->f_type = APFS_MAGIC;
+    buf->f_bsize = sb->s_blocksize;
+    buf->f_blocks = le64_to_cpu(glb_info->cnt->raw->block_count);
+    if (glb_info->vol_quota_count) {
+        buf->f_blocks = glb_info->vol_quota_count;
+        if (glb_info->vol_quota_count > glb_info->vol_alloc_count)
+            free = min(free, glb_info->vol_quota_count
+                    - glb_info->vol_alloc_count);
+        else
+            free = 0;
+    }
+    buf->f_bfree = free;
+    buf->f_bavail = free;
+    buf->f_files = glb_info->vol_objects + free;
+    buf->f_ffree = free;
+    buf->f_fsid.val[0] = (u32) glb_info->vol_fsid;
+    buf->f_fsid.val[1] = (u32) (glb_info->vol_fsid >> 32);
+    buf->f_namelen = APFS_NAME_LEN;
+
+    return 0;
+}
+
 static struct super_operations const apfs_super_ops = {
-    .put_super = apfs_put_super
+    .alloc_inode = apfs_alloc_inode,
+    .destroy_inode = apfs_destroy_inode,
+    .free_inode = apfs_free_inode,
+    .put_super = apfs_put_super,
+    .statfs = apfs_statfs
+};
+
+enum {
+    Opt_vol, Opt_snap, Opt_omap_cache_max, Opt_node_cache_max,
+    Opt_xattr_cache_max, Opt_dir_cache_max, Opt_dir_bloom_min, Opt_err
 };
 
-static int apfs_fill_sb(struct super_block* sb, void* data, int silent)
+static const match_table_t apfs_tokens = {
+    {Opt_vol, "vol=%u"},
+    {Opt_snap, "snap=%s"},
+    {Opt_omap_cache_max, "omap_cache_max=%u"},
+    {Opt_node_cache_max, "node_cache_max=%u"},
+    {Opt_xattr_cache_max, "xattr_cache_max=%u"},
+    {Opt_dir_cache_max, "dir_cache_max=%u"},
+    {Opt_dir_bloom_min, "dir_bloom_min=%u"},
+    {Opt_err, NULL}
+};
+
+/*
+ * Parse the mount options. 'vol' is the index of the volume in the
+ * container and 'snap' the name of the snapshot to mount; 'dir_bloom_min'
+ * is the number of entries from which a directory gets a Bloom filter (0
+ * disables them). The rest set the maximum number of objects of each cache
+ * of the volume (omap translations, B-Tree nodes, inodes with cached
+ * xattrs and directories with cached listings).
+ */
+static int parse_options(char* options, struct apfs_glb_info* glb_info)
 {
-    struct buffer_head *bh_cnt;
-    struct buffer_head *bh_vol;
-    struct buffer_head *bh;
+    substring_t args[MAX_OPT_ARGS];
+    char* p;
+    int token, val;
+
+    if (!options)
+        return 0;
+
+    while ((p = strsep(&options, ",")) != NULL) {
+        if (!*p)
+            continue;
+
+        token = match_token(p, apfs_tokens, args);
+        if (token == Opt_err) {
+            printk(KERN_ERR "apfs: unknown mount option [%s]\n", p);
+            return -EINVAL;
+        }
+        if (token == Opt_snap) {
+            kfree(glb_info->snap_name);
+            glb_info->snap_name = match_strdup(&args[0]);
+            if (!glb_info->snap_name)
+                return -ENOMEM;
+            continue;
+        }
+        if (match_int(&args[0], &val) || val < 0) {
+            printk(KERN_ERR "apfs: invalid value in option [%s]\n", p);
+            return -EINVAL;
+        }
+
+        switch (token) {
+        case Opt_vol:
+            glb_info->vol_index = val;
+            break;
+        case Opt_omap_cache_max:
+            glb_info->omap_cache_max = val;
+            break;
+        case Opt_node_cache_max:
+            glb_info->node_cache.max = val;
+            break;
+        case Opt_xattr_cache_max:
+            glb_info->xattr_lru.max = val;
+            break;
+        case Opt_dir_cache_max:
+            glb_info->dir_lru.max = val;
+            break;
+        case Opt_dir_bloom_min:
+            glb_info->dir_bloom_min = val;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+static struct apfs_glb_info* alloc_glb_info(void)
+{
+    struct apfs_glb_info* glb_info;
+
+    glb_info = kzalloc(sizeof(struct apfs_glb_info), GFP_KERNEL);
+    if (!glb_info) {
+        printk(KERN_ERR "apfs: not enought memory\n");
+        return NULL;
+    }
+
+    glb_info->omap_cache_max = APFS_OMAP_CACHE_MAX;
+    glb_info->dir_bloom_min = APFS_DIR_BLOOM_MIN;
+    apfs_node_cache_init(&glb_info->node_cache, APFS_NODE_CACHE_MAX);
+    apfs_inode_lru_init(&glb_info->xattr_lru, APFS_XATTR_LRU_MAX);
+    apfs_inode_lru_init(&glb_info->dir_lru, APFS_DIR_LRU_MAX);
+
+    /*
+     * Without the workqueue, the volume works without prefetching.
+     */
+    glb_info->prefetch_wq = alloc_workqueue("apfs-prefetch", WQ_UNBOUND, 0);
+    if (!glb_info->prefetch_wq)
+        printk(KERN_WARNING "apfs: unable to create the prefetch workqueue\n");
+
+    /*
+     * The node heat and the latencies are only reported in debugfs.
+     */
+    glb_info->heat = alloc_percpu(struct apfs_node_heat);
+    glb_info->latency = alloc_percpu(struct apfs_latency);
+
+    return glb_info;
+}
+
+static void free_glb_info(struct apfs_glb_info* glb_info)
+{
+#if IS_ENABLED(CONFIG_UNICODE)
+    if (glb_info->encoding)
+        utf8_unload(glb_info->encoding);
+#endif
+    if (glb_info->prefetch_wq)
+        destroy_workqueue(glb_info->prefetch_wq);
+    free_percpu(glb_info->heat);
+    free_percpu(glb_info->latency);
+    apfs_node_cache_destroy(&glb_info->node_cache);
+    apfs_put_container(glb_info->cnt);
+    kfree(glb_info->snap_name);
+    kfree(glb_info);
+}
+
+static int apfs_fill_sb(struct super_block* sb, int silent)
+{
+    struct apfs_buf* buf_vol;
+    struct apfs_buf* buf_snap;
+    struct apfs_buf* buf;
     
-    struct apfs_superblock_t* apfs_cnt;
+    struct apfs_container* cnt;
     struct apfs_vol_superblock_t* apfs_vol;
 
     struct apfs_omap_phys_t* omap_obj;
     struct apfs_glb_info* glb_info;
     struct inode* root_inode;
 
+    oid_t vol_oid;
     oid_t vol_block;
-    int ret = -ENOMEM;
-    
-    /*
-     * Read the superblock of the partition and fill the structure.
-     * TODO: Read the last valid superblock. Currently, the first partition 
-     * is read. This is correct if the device was properly unmounted.
-     */
-    bh_cnt = sb_bread(sb, APFS_SUPERBLOCK_BLOCK);
-    if (!bh_cnt) {
-        printk(KERN_ERR "apfs: unable to read the superblock\n");
-        goto end;
-    }
+    paddr_t omap_snap_tree;
+    paddr_t snap_block;
+    int ret = -EINVAL;
 
-    apfs_cnt = (struct apfs_superblock_t*) bh_cnt->b_data;
-    
-    sb->s_magic = le32_to_cpu(apfs_cnt->magic_number);
-    sb->s_blocksize = le32_to_cpu(apfs_cnt->block_size);
-    sb->s_op = &apfs_super_ops;
-        
-    if (sb->s_magic != APFS_MAGIC) {
-        printk(KERN_ERR "apfs: it is not an APFS partition\n");
-        goto release_sb;
-    }
+    glb_info = (struct apfs_glb_info*) sb->s_fs_info;
 
-    if (sb->s_blocksize < APFS_DEFAULT_BLOCK_SIZE 
-            || sb->s_blocksize > APFS_MAXIMUM_BLOCK_SIZE) {
-        printk(KERN_ERR "apfs: does not have a valid block size\n");
-        goto release_sb;
-    }
+    sb->s_op = &apfs_super_ops;
+    sb->s_xattr = apfs_xattr_handlers;
+    sb->s_export_op = &apfs_export_ops;
     
     /*
-     * It's a valid partition. We allocate memory for the structure stored in
-     * sb->s_fs_info.
+     * Get the container of the device. If other volumes of the container
+     * are mounted, it's shared with them.
      */
-    glb_info = kmalloc(sizeof(struct apfs_glb_info), GFP_KERNEL);
-    if (!glb_info) {
-        printk(KERN_ERR "apfs: not enought memory\n");
-        goto release_sb;
-    }
-    sb->s_fs_info = glb_info;
-    glb_info->cnt_oid = le64_to_cpu(apfs_cnt->obj_h.oid);
-    glb_info->cnt_xid = le64_to_cpu(apfs_cnt->obj_h.xid);
-
-    /*
-     * Start getting data from partition. First, we look for the block number
-     * of the container tree.
-     */
-    bh = sb_bread(sb, apfs_cnt->omap_oid);
-    if (!bh) {
-        printk(KERN_ERR "apfs: unable to read block [%llu]\n", 
-            apfs_cnt->omap_oid);
-        goto release_glb_info;
-    }
-    omap_obj = (struct apfs_omap_phys_t*) bh->b_data;
-    glb_info->cnt_omap_tree = le64_to_cpu(omap_obj->om_tree_oid);
-    brelse(bh);
+    cnt = apfs_get_container(sb, glb_info->omap_cache_max);
+    if (!cnt)
+        goto end;
+    glb_info->cnt = cnt;
+    sb->s_magic = APFS_MAGIC;
     
     /*
      * We get the block number of the volume structure.
-     * TODO: Allow to choose the volume. For now, we mount the first volume 
-     * (apfs_cnt->fs_oid[0]).
      */
-    vol_block = le64_to_cpu(get_phys_block(sb, glb_info->cnt_omap_tree,
-                apfs_cnt->fs_oid[0], glb_info->cnt_xid));
+    if (glb_info->vol_index >= le32_to_cpu(cnt->raw->max_file_systems)
+            || glb_info->vol_index >= APFS_MAX_FILE_SYSTEMS
+            || !cnt->raw->fs_oid[glb_info->vol_index]) {
+        printk(KERN_ERR "apfs: volume [%u] doesn't exist\n",
+                glb_info->vol_index);
+        goto end;
+    }
+    vol_oid = le64_to_cpu(cnt->raw->fs_oid[glb_info->vol_index]);
+
+    vol_block = get_phys_block(sb, cnt->omap_tree, vol_oid, cnt->xid);
     if (vol_block == 0) {
-        printk(KERN_ERR "apfs: invalid object id [%llu]\n",
-                apfs_cnt->fs_oid[0]);
-        goto release_glb_info;
+        printk(KERN_ERR "apfs: invalid object id [%llu]\n", vol_oid);
+        goto end;
     }
      
     /*
      * Read the structure of the volume (i.e. apfs_vol_superblock_t).
      */
-    bh_vol = sb_bread(sb, vol_block);
-    if (!bh_vol){
+    buf_vol = apfs_read_block(sb, vol_block);
+    if (!buf_vol){
         printk(KERN_ERR "apfs: unable to read block [%llu]\n", 
                 vol_block);
-        goto release_glb_info;
+        goto end;
     }
-    apfs_vol = (struct apfs_vol_superblock_t*) bh_vol->b_data;
+    apfs_vol = (struct apfs_vol_superblock_t*) buf_vol->data;
     glb_info->vol_oid = le64_to_cpu(apfs_vol->obj_h.oid);
     glb_info->vol_xid = le64_to_cpu(apfs_vol->obj_h.xid);
+    glb_info->vol_incompat = le64_to_cpu(apfs_vol->apfs_incompatible_features);
+
+    /*
+     * Case-insensitive volumes need their own dentry operations, so the
+     * case variants of a name share the same dentry.
+     */
+    if (glb_info->vol_incompat & APFS_INCOMPAT_CASE_INSENSITIVE) {
+#if IS_ENABLED(CONFIG_UNICODE)
+        glb_info->encoding = utf8_load("12.1.0");
+        if (IS_ERR(glb_info->encoding)) {
+            printk(KERN_WARNING "apfs: unable to load utf8 tables, "
+                    "only ASCII names will be casefolded\n");
+            glb_info->encoding = NULL;
+        }
+#endif
+        sb->s_d_op = &apfs_ci_dentry_operations;
+    }
      
     /*
      * Get the block number of the omap tree of the volume.
      */
-    bh = sb_bread(sb, apfs_vol->apfs_omap_oid);
-    if (!bh){
+    buf = apfs_read_block(sb, le64_to_cpu(apfs_vol->apfs_omap_oid));
+    if (!buf){
         printk(KERN_ERR "apfs: unable to read block [%llu]\n", 
                 apfs_vol->apfs_omap_oid);
         goto release_vol;
     }
-    omap_obj = (struct apfs_omap_phys_t*) bh->b_data;
+    omap_obj = (struct apfs_omap_phys_t*) buf->data;
     glb_info->vol_omap_tree = le64_to_cpu(omap_obj->om_tree_oid);
-    brelse(bh);
+    omap_snap_tree = le64_to_cpu(omap_obj->om_snapshot_tree_oid);
+    apfs_release_block(buf);
+
+    /*
+     * A snapshot has its own copy of the volume superblock, and its
+     * objects are found in the omap of the volume at the xid of the
+     * snapshot.
+     */
+    if (glb_info->snap_name) {
+        ret = apfs_find_snapshot(sb, apfs_vol, omap_snap_tree,
+                glb_info->snap_name, &glb_info->vol_xid, &snap_block);
+        if (ret)
+            goto release_vol;
+
+        buf_snap = apfs_read_block(sb, snap_block);
+        if (!buf_snap) {
+            ret = -EIO;
+            goto release_vol;
+        }
+        apfs_release_block(buf_vol);
+        buf_vol = buf_snap;
+        apfs_vol = (struct apfs_vol_superblock_t*) buf_vol->data;
+        ret = -EINVAL;
+    }
      
+    /*
+     * The counters of the volume are saved for statfs, so it doesn't read
+     * the volume superblock again.
+     */
+    glb_info->vol_alloc_count = le64_to_cpu(apfs_vol->apfs_fs_alloc_count);
+    glb_info->vol_quota_count =
+        le64_to_cpu(apfs_vol->apfs_fs_quota_block_count);
+    glb_info->vol_objects = le64_to_cpu(apfs_vol->apfs_num_files)
+        + le64_to_cpu(apfs_vol->apfs_num_directories)
+        + le64_to_cpu(apfs_vol->apfs_num_symlinks)
+        + le64_to_cpu(apfs_vol->apfs_num_other_fsobjects);
+    glb_info->vol_fsid = get_unaligned_le64(apfs_vol->apfs_vol_uuid)
+        ^ get_unaligned_le64(apfs_vol->apfs_vol_uuid + 8);
+
     /*
      * Get the block number of the root dir.
      */
-    glb_info->vol_root_tree = le64_to_cpu(get_phys_block(sb,
-                glb_info->vol_omap_tree, apfs_vol->apfs_root_tree_oid,
-                glb_info->vol_xid)); 
+    glb_info->vol_root_tree = get_phys_block(sb, glb_info->vol_omap_tree,
+                le64_to_cpu(apfs_vol->apfs_root_tree_oid),
+                glb_info->vol_xid); 
     if (glb_info->vol_root_tree == 0) {
         printk(KERN_ERR "apfs: invalid object id [%llu]\n",
                 apfs_vol->apfs_root_tree_oid);
@@ -167,48 +429,169 @@ static int apfs_fill_sb(struct super_block* sb, void* data, int silent)
     if (!root_inode) {
         goto release_vol;
     }
+
+    ret = apfs_register_shrinker(glb_info);
+    if (ret) {
+        printk(KERN_ERR "apfs: unable to register the shrinker\n");
+        iput(root_inode);
+        goto release_vol;
+    }
     
     sb->s_root = d_make_root(root_inode);
     if (!sb->s_root) {
         printk(KERN_ERR "apfs: root creation failed\n");
+        apfs_unregister_shrinker(glb_info);
+        ret = -ENOMEM;
         goto release_vol;
     }
 
-    brelse(bh_vol);
-    brelse(bh_cnt);
+    apfs_release_block(buf_vol);
+    apfs_debugfs_register(sb);
     
     return 0;
 
 release_vol:
-    brelse(bh_vol);   
-release_glb_info:
-    kfree(glb_info);
-release_sb:
-    brelse(bh_cnt);
+    apfs_release_block(buf_vol);   
 end:
     return ret;
 }
 
+/*
+ * A superblock is shared by the mounts of the same volume (or snapshot) of
+ * a device.
+ */
+static int apfs_test_super(struct super_block* sb, void* data)
+{
+    struct apfs_glb_info* glb_info;
+    struct apfs_glb_info* new_info;
+
+    glb_info = (struct apfs_glb_info*) sb->s_fs_info;
+    new_info = (struct apfs_glb_info*) data;
+
+    if (glb_info->bdev != new_info->bdev
+            || glb_info->vol_index != new_info->vol_index)
+        return 0;
+
+    if (!glb_info->snap_name || !new_info->snap_name)
+        return glb_info->snap_name == new_info->snap_name;
+
+    return !strcmp(glb_info->snap_name, new_info->snap_name);
+}
+
+/*
+ * Each volume gets its own anonymous device number, as several volumes of
+ * the same device can be mounted at once.
+ */
+static int apfs_set_super(struct super_block* sb, void* data)
+{
+    struct apfs_glb_info* glb_info;
+    int err;
+
+    glb_info = (struct apfs_glb_info*) data;
+
+    err = set_anon_super(sb, NULL);
+    if (err)
+        return err;
+
+    sb->s_bdev = glb_info->bdev;
+    sb->s_bdi = bdi_get(glb_info->bdev->bd_bdi);
+    sb->s_fs_info = glb_info;
+
+    return 0;
+}
+
 static struct dentry* apfs_mount (struct file_system_type* type, 
         int flags, char const* dev, void* data)
 {
-    struct dentry* entry;
-    entry = mount_bdev(type, flags, dev, data, apfs_fill_sb);
+    struct apfs_glb_info* glb_info;
+    struct block_device* bdev;
+    struct super_block* sb;
+    fmode_t mode;
+    int err;
 
-    if (unlikely(IS_ERR(entry)))
-        printk(KERN_ERR "apfs: error mounting\n");
-    else
-        printk(KERN_INFO "apfs: succesfully mounted on [%s]\n",
-                dev);
+    mode = FMODE_READ | FMODE_EXCL;
+
+    glb_info = alloc_glb_info();
+    if (!glb_info)
+        return ERR_PTR(-ENOMEM);
+
+    err = parse_options(data, glb_info);
+    if (err)
+        goto free_info;
+
+    bdev = blkdev_get_by_path(dev, mode, type);
+    if (IS_ERR(bdev)) {
+        err = PTR_ERR(bdev);
+        goto free_info;
+    }
+    glb_info->bdev = bdev;
+
+    sb = sget(type, apfs_test_super, apfs_set_super, flags | SB_NOSEC,
+            glb_info);
+    if (IS_ERR(sb)) {
+        err = PTR_ERR(sb);
+        goto put_bdev;
+    }
+
+    if (sb->s_root) {
+        /*
+         * The volume is already mounted.
+         */
+        free_glb_info(glb_info);
+        blkdev_put(bdev, mode);
+        if ((flags ^ sb->s_flags) & SB_RDONLY) {
+            deactivate_locked_super(sb);
+            return ERR_PTR(-EBUSY);
+        }
+    } else {
+        sb->s_mode = mode;
+        snprintf(sb->s_id, sizeof(sb->s_id), "%pg", bdev);
+        err = apfs_fill_sb(sb, flags & SB_SILENT ? 1 : 0);
+        if (err) {
+            printk(KERN_ERR "apfs: error mounting\n");
+            deactivate_locked_super(sb);
+            return ERR_PTR(err);
+        }
+        sb->s_flags |= SB_ACTIVE;
+        printk(KERN_INFO "apfs: succesfully mounted on [%s]\n", dev);
+    }
+
+    return dget(sb->s_root);
+
+put_bdev:
+    blkdev_put(bdev, mode);
+free_info:
+    free_glb_info(glb_info);
+    return ERR_PTR(err);
+}
+
+static void apfs_kill_sb(struct super_block* sb)
+{
+    struct apfs_glb_info* glb_info;
+    struct block_device* bdev;
+    fmode_t mode;
 
-    return entry;
+    glb_info = (struct apfs_glb_info*) sb->s_fs_info;
+    bdev = sb->s_bdev;
+    mode = sb->s_mode;
+
+    /*
+     * The pending prefetches hold references to inodes.
+     */
+    if (glb_info->prefetch_wq)
+        drain_workqueue(glb_info->prefetch_wq);
+    apfs_debugfs_unregister(sb);
+
+    kill_anon_super(sb);
+    free_glb_info(glb_info);
+    blkdev_put(bdev, mode);
 }
 
 static struct file_system_type apfs_fs_type = {
     .owner      = THIS_MODULE,
     .name       = "apfs",
     .mount      = apfs_mount,
-    .kill_sb    = kill_block_super,
+    .kill_sb    = apfs_kill_sb,
     .fs_flags   = FS_REQUIRES_DEV,
 };
 MODULE_ALIAS_FS("apfs");
@@ -217,12 +600,27 @@ static int __init init_apfs_fs(void)
 {
     int err;
 
+    apfs_inode_cachep = kmem_cache_create("apfs_inode_cache",
+            sizeof(struct apfs_inode_info), 0,
+            SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD | SLAB_ACCOUNT,
+            apfs_inode_init_once);
+    if (!apfs_inode_cachep) {
+        printk(KERN_ERR "apfs: failed to create the inode cache\n");
+        return -ENOMEM;
+    }
+
+    apfs_debugfs_init();
+    apfs_kunit_init();
+
     err = register_filesystem(&apfs_fs_type);
     if (likely(!err)) {
         printk(KERN_INFO "apfs: sucessfully registered\n");
     } else {
         printk(KERN_ERR "apfs: failed to register. Error[%d]\n", 
                 err);
+        apfs_kunit_exit();
+        apfs_debugfs_exit();
+        kmem_cache_destroy(apfs_inode_cachep);
         return err;
     }
 
@@ -235,6 +633,15 @@ static void __exit exit_apfs_fs(void)
 
     err = unregister_filesystem(&apfs_fs_type);
 
+    /*
+     * Make sure all the delayed rcu free inodes are released before
+     * destroying the cache.
+     */
+    rcu_barrier();
+    kmem_cache_destroy(apfs_inode_cachep);
+    apfs_kunit_exit();
+    apfs_debugfs_exit();
+
     if (likely(!err))
         printk(KERN_INFO "apfs: sucessfully unregistered\n");
     else
@@ -0,0 +1,225 @@
+/*
+ * This file is part of the APFS-Module.
+ * Copyright (c) 2019 Jordi Barcons.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * stat() scaling benchmark. The paths below a directory are collected
+ * once, and then 1, 2, 4... threads stat() them in a loop for a while. All
+ * the dentries are cached after the first pass, so the throughput shows
+ * how the path walk scales with the number of cores.
+ *
+ *   stat_bench [-t max_threads] [-s seconds] [-n max_paths] <dir>
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+
+struct bench_thread {
+    pthread_t thread;
+    int id;
+    unsigned long stats;
+    unsigned long errors;
+};
+
+static char** paths;
+static size_t path_count;
+static size_t path_max = 100000;
+
+static volatile int start_flag;
+static volatile int stop_flag;
+
+static int add_path(const char* path, const struct stat* st, int type,
+        struct FTW* ftw)
+{
+    static size_t size;
+    char** new_paths;
+
+    if (path_count == path_max)
+        return 1;
+
+    if (path_count == size) {
+        size = size ? size * 2 : 1024;
+        new_paths = realloc(paths, size * sizeof(*paths));
+        if (!new_paths)
+            return -1;
+        paths = new_paths;
+    }
+
+    paths[path_count] = strdup(path);
+    if (!paths[path_count])
+        return -1;
+    path_count++;
+
+    return 0;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Each thread starts in a different position of the list, so the threads
+ * don't walk the same paths at the same time.
+ */
+static void* bench_thread(void* arg)
+{
+    struct bench_thread* bt;
+    struct stat st;
+    size_t c;
+
+    bt = (struct bench_thread*) arg;
+    c = (path_count / 64 + 1) * bt->id % path_count;
+
+    while (!start_flag)
+        ;
+
+    while (!stop_flag) {
+        if (stat(paths[c], &st))
+            bt->errors++;
+        bt->stats++;
+        if (++c == path_count)
+            c = 0;
+    }
+
+    return NULL;
+}
+
+/*
+ * Run 'nthreads' threads for 'seconds'. Returns the stat() calls per second.
+ */
+static double run(int nthreads, double seconds, unsigned long* errors)
+{
+    struct bench_thread* threads;
+    unsigned long total;
+    double start, elapsed;
+    int c;
+
+    threads = calloc(nthreads, sizeof(*threads));
+    if (!threads) {
+        perror("calloc");
+        exit(1);
+    }
+
+    start_flag = 0;
+    stop_flag = 0;
+    for (c = 0; c < nthreads; c++) {
+        threads[c].id = c;
+        errno = pthread_create(&threads[c].thread, NULL, bench_thread,
+                &threads[c]);
+        if (errno) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    start = now();
+    start_flag = 1;
+    usleep(seconds * 1e6);
+    stop_flag = 1;
+
+    total = 0;
+    *errors = 0;
+    for (c = 0; c < nthreads; c++) {
+        pthread_join(threads[c].thread, NULL);
+        total += threads[c].stats;
+        *errors += threads[c].errors;
+    }
+    elapsed = now() - start;
+    free(threads);
+
+    return total / elapsed;
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr, "usage: %s [-t max_threads] [-s seconds] "
+            "[-n max_paths] <dir>\n", name);
+    exit(1);
+}
+
+int main(int argc, char** argv)
+{
+    struct stat st;
+    unsigned long errors;
+    double seconds, rate, base;
+    int max_threads, nthreads, opt;
+    size_t c;
+
+    max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    seconds = 2;
+
+    while ((opt = getopt(argc, argv, "t:s:n:")) != -1) {
+        switch (opt) {
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 's':
+            seconds = atof(optarg);
+            break;
+        case 'n':
+            path_max = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || max_threads < 1 || seconds <= 0
+            || path_max == 0)
+        usage(argv[0]);
+
+    if (nftw(argv[optind], add_path, 64, FTW_PHYS) < 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+    if (!path_count) {
+        fprintf(stderr, "%s: no paths found\n", argv[optind]);
+        return 1;
+    }
+
+    /*
+     * One pass to fill the dentry and inode caches.
+     */
+    for (c = 0; c < path_count; c++)
+        stat(paths[c], &st);
+
+    printf("%zu paths, %.1f s per run\n", path_count, seconds);
+    printf("threads      stats/s   per thread  speedup  errors\n");
+    base = 0;
+    for (nthreads = 1; ; nthreads *= 2) {
+        if (nthreads > max_threads)
+            nthreads = max_threads;
+        rate = run(nthreads, seconds, &errors);
+        if (!base)
+            base = rate;
+        printf("%7d %12.0f %12.0f %7.2fx %7lu\n", nthreads, rate,
+                rate / nthreads, rate / base, errors);
+        if (nthreads == max_threads)
+            break;
+    }
+
+    return 0;
+}
@@ -15,18 +15,15 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <linux/buffer_head.h>
 #include <linux/kernel.h>
 #include <linux/slab.h>
+#include <linux/ktime.h>
 
 #include "apfs.h"
 #include "apfs/btree.h"
 #include "apfs/volume.h"
 #include "apfs/omap.h"
 
-#define CMP_NODE_NONLEAF    0
-#define CMP_NODE_LEAF       1
-
 /*
  * Returns the id of a file-system object. 
  */
@@ -86,7 +83,7 @@ int cmp_omap_toc_keys(u_int64_t oid, u_int64_t xid,
         return 0;
         
     if ((oid == oid_c && xid > xid_c)
-            || (oid >= oid_c && node_type == CMP_NODE_NONLEAF))
+            || (oid > oid_c && node_type == CMP_NODE_NONLEAF))
         return 2;
     
     if (oid > oid_c)
@@ -147,7 +144,7 @@ int cmp_fstree_toc_keys(u_int64_t oid, u_int64_t otype, char* name,
         u_int64_t oid_c, u_int64_t otype_c, char* name_c,
         u_int8_t type)
 {
-    u_int8_t strc;
+    int strc;
     
     if (name == NULL || name_c == NULL) {
         strc = 0;
@@ -308,134 +305,197 @@ u_int8_t* find_in_node(struct super_block* sb,
 }
 
 /*
- * Return a pyshical block of the specific object.
+ * Returns the range of transactions that see the version of the omap
+ * record in the position 'pos' of a leaf: from its own xid to the xid
+ * before the next version of the object. If the next version may be in
+ * another node, the range ends in 'xid', which is known to see it.
  */
-u_int64_t get_phys_block(struct super_block* sb, paddr_t omap,
-        u_int64_t oid, u_int64_t xid)
+static void get_omap_version(struct apfs_btree_node_phys_t* node, int pos,
+        u_int64_t oid, u_int64_t xid, u_int64_t* ver_xid, u_int64_t* max_xid)
 {
-    struct buffer_head *bh;
-    struct apfs_btree_node_phys_t* omap_nde;
+    u_int64_t k_oid, k_xid;
+
+    get_omap_key(node, pos, &k_oid, ver_xid);
+
+    if (!get_omap_key(node, pos + 1, &k_oid, &k_xid))
+        *max_xid = xid;
+    else if (k_oid == oid)
+        *max_xid = k_xid - 1;
+    else
+        *max_xid = U64_MAX;
+}
+
+/*
+ * Walk the omap down to the version of the object seen by 'xid'. The nodes
+ * are read through the node cache if 'cached'. Returns the physical block
+ * of the object and the range of transactions of its version, or 0.
+ */
+static u_int64_t walk_omap(struct super_block* sb, paddr_t omap,
+        u_int64_t oid, u_int64_t xid, bool cached, u_int64_t* ver_xid,
+        u_int64_t* max_xid)
+{
+    struct apfs_node* node;
     struct apfs_kvoff_t* kvoff;
     u_int64_t block_n;
-    
-    bh = sb_bread(sb, omap);
-    if (!bh) {
-        printk(KERN_ERR "apfs: unable to read block [%llu]\n",
-                omap);
-        return 0;
-    }
-    omap_nde = (struct apfs_btree_node_phys_t*) bh->b_data;
-        
-    while (le16_to_cpu(omap_nde->btn_level) >= 0)
-    {
-        kvoff = (struct apfs_kvoff_t*) find_in_node(sb, omap_nde, oid, xid, 
-                NULL, APFS_OBJ_TYPE_OMAP);
-        brelse(bh);
-        
-        if (!kvoff)
+    int level, expected;
+
+    /*
+     * Each child must be one level below its parent. The nodes are never
+     * above APFS_BTREE_MAX_DEPTH, so a corrupt omap that points back to an
+     * ancestor can't make the walk longer than that.
+     */
+    block_n = omap;
+    expected = -1;
+    do {
+        if (cached)
+            node = apfs_node_get(sb, block_n);
+        else
+            node = apfs_node_get_uncached(sb, block_n);
+        if (!node)
             return 0;
-        
-        block_n = get_omap_value(sb, omap_nde, kvoff);
-        
-        if (le16_to_cpu(omap_nde->btn_level) == 0)
-            return block_n;
-        
-        bh = sb_bread(sb, block_n);
-        if (!bh) {
-            printk(KERN_ERR "apfs: unable to read block [%llu]\n",
-                    block_n);
+
+        if (expected >= 0 && node->level != expected) {
+            printk(KERN_ERR "apfs: invalid level in node [%llu]\n", block_n);
+            apfs_node_put(node);
             return 0;
         }
-        omap_nde = (struct apfs_btree_node_phys_t*) bh->b_data; 
-    }
-    
-    brelse(bh);
+
+        kvoff = (struct apfs_kvoff_t*) find_in_node(sb, node->phys, oid, xid, 
+                NULL, APFS_OBJ_TYPE_OMAP);
+        if (!kvoff) {
+            apfs_node_put(node);
+            return 0;
+        }
+
+        block_n = get_omap_value(sb, node->phys, kvoff);
+        level = node->level;
+        expected = level - 1;
+        if (level == 0)
+            get_omap_version(node->phys,
+                    ((u_int8_t*) kvoff - node->toc) / sizeof(*kvoff),
+                    oid, xid, ver_xid, max_xid);
+        apfs_node_put(node);
+    } while (level > 0);
+
+    return block_n;
+}
+
+/*
+ * Return a pyshical block of the specific object. The nodes of the omap
+ * are read through the node cache, and the translations are cached in the
+ * omap cache of the container, shared by all its volumes and snapshots.
+ */
+u_int64_t get_phys_block(struct super_block* sb, paddr_t omap,
+        u_int64_t oid, u_int64_t xid)
+{
+    struct apfs_glb_info* glb_info;
+    struct apfs_omap_cache* cache;
+    u_int64_t block_n, ver_xid, max_xid;
+    u_int64_t start;
     
-    return 0;
+    start = ktime_get_ns();
+    glb_info = (struct apfs_glb_info*) sb->s_fs_info;
+    cache = &glb_info->cnt->omap_cache;
+
+    block_n = apfs_omap_cache_lookup(cache, omap, oid, xid);
+    if (block_n)
+        goto out;
+
+    block_n = walk_omap(sb, omap, oid, xid, true, &ver_xid, &max_xid);
+    if (block_n)
+        apfs_omap_cache_insert(cache, omap, oid, ver_xid, max_xid, block_n);
+
+out:
+    apfs_lat_record(sb, APFS_LAT_OMAP, start);
+    return block_n;
 }
 
 /*
- * Allocate and return an inode structure from the disk.
+ * Like get_phys_block(), but the omap nodes read from the disk are not added
+ * to the node cache and the translation is not added to the omap cache.
+ * Used by the walks of whole trees, that would evict the cached entries.
  */
-struct apfs_record_inode_val_t* get_inode_from_disk(struct super_block* sb,
-        u_int64_t i_no)
+u_int64_t get_phys_block_uncached(struct super_block* sb, paddr_t omap,
+        u_int64_t oid, u_int64_t xid)
 {
-    struct buffer_head *fs_tree_bh;
-    struct buffer_head *aux_bh;
-    struct apfs_btree_node_phys_t* fs_tree_node;
     struct apfs_glb_info* glb_info;
+    u_int64_t block_n, ver_xid, max_xid;
+
+    glb_info = (struct apfs_glb_info*) sb->s_fs_info;
+    block_n = apfs_omap_cache_lookup(&glb_info->cnt->omap_cache, omap, oid,
+            xid);
+    if (block_n)
+        return block_n;
+
+    return walk_omap(sb, omap, oid, xid, false, &ver_xid, &max_xid);
+}
+
+/*
+ * Allocate and return a copy of an inode record. If the record doesn't
+ * have extended fields, an empty apfs_xf_blob_t is added.
+ */
+struct apfs_record_inode_val_t* copy_inode_val(void* val, int len)
+{
     struct apfs_record_inode_val_t* apfs_inode;
     struct apfs_xf_blob_t* xf;
-    struct apfs_kvloc_t* kvloc;
     u_int8_t min_xfield_len;
     u_int8_t* ptr;
-    
-    glb_info = (struct apfs_glb_info*) sb->s_fs_info;
-    
-    /*
-     * Search the inode structure in the device.
-     */
-    fs_tree_bh = sb_bread(sb, glb_info->vol_root_tree);
-    if (!fs_tree_bh) {
-        printk(KERN_ERR "apfs: unable to read block [%llu]\n", 
-                glb_info->vol_root_tree);
-        goto end;
+
+    if (len < sizeof(struct apfs_record_inode_val_t)) {
+        printk(KERN_ERR "apfs: invalid inode record\n");
+        return NULL;
     }
-    fs_tree_node = (struct apfs_btree_node_phys_t*) fs_tree_bh->b_data;
+
+    min_xfield_len = 0;
     
-    while (le16_to_cpu(fs_tree_node->btn_level) > 0) {
-        kvloc = (struct apfs_kvloc_t*) find_in_node(sb, fs_tree_node, i_no, 
-                APFS_TYPE_INODE, NULL, APFS_OBJ_TYPE_FSTREE);
-        
-        if (!kvloc) {
-            printk(KERN_ERR "apfs: inode %llu not found", i_no);
-            goto release_bh;
-        }
+    if (sizeof(struct apfs_record_inode_val_t) == len)
+        min_xfield_len = sizeof(struct apfs_xf_blob_t);
         
-        aux_bh = fs_tree_bh;
-        fs_tree_bh = get_fstree_child(sb, fs_tree_node, kvloc);
-        brelse(aux_bh);
-        
-        if (!fs_tree_bh) {
-            printk(KERN_ERR "apfs: unable to read block\n"); 
-            goto end;
-        }
-        fs_tree_node = (struct apfs_btree_node_phys_t*) fs_tree_bh->b_data;
+    ptr = kmalloc(len + min_xfield_len, GFP_KERNEL);
+    if (!ptr) {
+        printk(KERN_ERR "apfs: not enought memory\n");
+        return NULL;
     }
-        
-    if (le16_to_cpu(fs_tree_node->btn_level) == 0) {
-        /*
-         * We are in the leaf node. Now, we search the inode.
-         * Finally, allocate memory for it.
-         */
-        kvloc = (struct apfs_kvloc_t*) find_in_node(sb, fs_tree_node, i_no, 
-                APFS_TYPE_INODE, NULL, APFS_OBJ_TYPE_FSTREE);
-        min_xfield_len = 0;
-        
-        if (sizeof(struct apfs_record_inode_val_t) == le16_to_cpu(kvloc->v.len))
-            min_xfield_len = sizeof(struct apfs_xf_blob_t);
-            
-        ptr = kmalloc(le16_to_cpu(kvloc->v.len) + min_xfield_len, GFP_KERNEL);
-        if (!ptr) {
-            printk(KERN_ERR "apfs: not enought memory\n");
-            goto release_bh;
-        }
-        memcpy(ptr, get_val_zone(sb, fs_tree_node) 
-                - le16_to_cpu(kvloc->v.off), le16_to_cpu(kvloc->v.len));
-        
-        apfs_inode = (struct apfs_record_inode_val_t*) ptr;
-        if (sizeof(struct apfs_record_inode_val_t) == le16_to_cpu(kvloc->v.len)) {
-            xf = (struct apfs_xf_blob_t*) apfs_inode->xfields;
-            xf->xf_num_exts = xf->xf_used_data = 0;
-        }
+    memcpy(ptr, val, len);
+    
+    apfs_inode = (struct apfs_record_inode_val_t*) ptr;
+    if (sizeof(struct apfs_record_inode_val_t) == len) {
+        xf = (struct apfs_xf_blob_t*) apfs_inode->xfields;
+        xf->xf_num_exts = xf->xf_used_data = 0;
+    }
+
+    return apfs_inode;
+}
 
-        return apfs_inode;
+/*
+ * Allocate and return an inode structure from the disk. The leaf of the
+ * record is saved in 'hint'.
+ */
+struct apfs_record_inode_val_t* get_inode_from_disk(struct super_block* sb,
+        u_int64_t i_no, struct apfs_btree_hint* hint)
+{
+    struct apfs_btree_cursor cur;
+    struct apfs_record_inode_val_t* apfs_inode;
+    u_int64_t start;
+    void* val;
+    int len;
+    
+    start = ktime_get_ns();
+    apfs_inode = NULL;
+    apfs_fstree_cursor_init(&cur, sb);
+    apfs_btree_cursor_hint(&cur, hint);
+
+    if (apfs_btree_seek(&cur, i_no, APFS_TYPE_INODE, 0) == 0) {
+        val = apfs_btree_val(&cur, &len);
+        apfs_inode = copy_inode_val(val, len);
+    } else {
+        printk(KERN_ERR "apfs: inode %llu not found", i_no);
     }
-        
-release_bh:
-        brelse(fs_tree_bh);
-end:
-        return NULL;
+
+    apfs_btree_cursor_release(&cur);
+    apfs_lat_record(sb, APFS_LAT_INODE, start);
+
+    return apfs_inode;
 }
 
 /*
@@ -469,126 +529,6 @@ u_int64_t get_inode_size (struct apfs_record_inode_val_t* inode)
     return 0;
 } 
 
-/*
- * Returns the node that has all the information of an inode. 
- * If the inode records are divided into two nodes, the 
- * function will return the parent of these nodes.
- */
-struct buffer_head* get_inode_branch(struct super_block* sb,
-        u_int64_t i_no) 
-{
-    struct apfs_glb_info* glb_info;
-    struct buffer_head *fs_tree_bh;
-    struct buffer_head *aux_bh;
-    struct apfs_btree_node_phys_t* fs_tree_node;
-    struct apfs_kvloc_t* kvloc;
-    struct apfs_record_key_t* k_val;
-    u_int8_t found;
-    u_int64_t key_pos;
-    u_int8_t* key_zone;
-    oid_t oid_fnd;
-    
-    glb_info = (struct apfs_glb_info*) sb->s_fs_info;
-    
-    /*
-     * Load the B-tree of the root dir.
-     */
-    fs_tree_bh = sb_bread(sb, glb_info->vol_root_tree);
-    if (!fs_tree_bh) {
-        printk(KERN_ERR "apfs: unable to read block [%llu]\n", 
-                glb_info->vol_root_tree);
-        goto end;
-    }
-    
-    fs_tree_node = (struct apfs_btree_node_phys_t*) fs_tree_bh->b_data;
-        
-    found = 0;
-    while (fs_tree_node->btn_level > 0 && !found) {
-        /*
-         * Search for the object in the node.
-         */
-        
-        kvloc = (struct apfs_kvloc_t*) find_in_node(sb, fs_tree_node, i_no, 
-                APFS_TYPE_INODE, NULL, APFS_OBJ_TYPE_FSTREE);
-        
-        if (!kvloc) {
-            printk(KERN_ERR "apfs: inode %llu not found", i_no);
-            goto release_bh;
-        }
-                
-        /*
-         * Find the next element. If it's the same object_id, the data
-         * of this object is distributed among different nodes.
-         */
-        key_pos = (((u_int8_t *)kvloc) - get_toc_zone(fs_tree_node))/sizeof(*kvloc);
-        
-        if (key_pos < le32_to_cpu(fs_tree_node->btn_nkeys)) {
-            kvloc++;
-            key_zone = get_key_zone(fs_tree_node);
-            k_val = (struct apfs_record_key_t*)(key_zone + le16_to_cpu(kvloc->k.off));
-            oid_fnd = k_val->obj_id_and_type & APFS_OBJ_ID_MASK;
-            if (oid_fnd == i_no)
-                found = 1;
-            kvloc--;
-        }
-                
-        /*
-         * Go to the next level!
-         */
-        if (!found) {
-            aux_bh = fs_tree_bh;
-            fs_tree_bh = get_fstree_child(sb, fs_tree_node, kvloc);
-            brelse(aux_bh);
-        
-            if (!fs_tree_bh) {
-                printk(KERN_ERR "apfs: unable to read block\n"); 
-                goto end;
-            }
-            fs_tree_node = (struct apfs_btree_node_phys_t*) fs_tree_bh->b_data;
-        }
-    }
-        
-    return fs_tree_bh;
-    
-release_bh:
-    brelse(fs_tree_bh);
-end:
-    return NULL;
-}
-
-/*
- * Returns the buffer_head of the next node indicated by kvloc
- * in the hierarchy
- */
-struct buffer_head* get_fstree_child (struct super_block* sb,
-        struct apfs_btree_node_phys_t* node, struct apfs_kvloc_t* kvloc)
-{
-    struct apfs_glb_info* glb_info;
-    struct buffer_head* bh;
-    oid_t oid;
-    paddr_t block_n;
-    
-    glb_info = (struct apfs_glb_info*) sb->s_fs_info;
-    
-    oid = get_fstree_value(sb, node, kvloc);
-    block_n = get_phys_block(sb, glb_info->vol_omap_tree, oid,
-            glb_info->vol_xid);
-    
-    if (!block_n) {
-        printk(KERN_ERR "apfs: object id not found [%llu]", oid);
-        return NULL;
-    }
-    
-    bh = sb_bread(sb, block_n);
-    if (!bh) {
-        printk(KERN_ERR "apfs: unable to read block [%llu]\n",
-                glb_info->vol_root_tree);
-        return NULL;
-    }
-
-    return bh;
-}
-
 /*
  * TODO: Implement a real unicode normalization function.
  */
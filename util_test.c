@@ -0,0 +1,553 @@
+/*
+ * This file is part of the APFS-Module.
+ * Copyright (c) 2019 Jordi Barcons.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <kunit/test.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+
+#include "apfs.h"
+#include "apfs/btree.h"
+#include "apfs/volume.h"
+#include "apfs/omap.h"
+
+/*
+ * KUnit tests of the node search and the key comparisons of util.c. The
+ * nodes are built in memory, and find_in_node() is checked against a
+ * linear scan of the same keys for every node size and searched key. The
+ * benchmark reports the time per search for several fill levels of the
+ * nodes.
+ */
+#define TEST_BLOCK_SIZE         4096
+#define TEST_NODE_SPACE         (TEST_BLOCK_SIZE \
+        - sizeof(struct apfs_btree_node_phys_t))
+#define TEST_OMAP_MAX_KEYS      (TEST_NODE_SPACE / (sizeof(struct apfs_kvoff_t) \
+        + sizeof(struct apfs_omap_key_t) + sizeof(struct apfs_omap_val_t)))
+#define TEST_FSTREE_MAX_KEYS    (TEST_NODE_SPACE / (sizeof(struct apfs_kvloc_t) \
+        + sizeof(struct apfs_record_key_t) + sizeof(u_int64_t)))
+#define TEST_BENCH_SEARCHES     20000
+
+/*
+ * A key of the test nodes. For the omap nodes, 'sub' is the xid; for the
+ * fstree nodes, it's the record type.
+ */
+struct test_key {
+    u_int64_t oid;
+    u_int64_t sub;
+};
+
+static struct super_block* test_sb(struct kunit* test)
+{
+    struct super_block* sb;
+
+    sb = kunit_kzalloc(test, sizeof(*sb), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, sb);
+    sb->s_blocksize = TEST_BLOCK_SIZE;
+
+    return sb;
+}
+
+/*
+ * The omap keys have three versions of each object, and the objects leave
+ * gaps between them: (100, 10) (100, 15) (100, 20) (102, 10)...
+ */
+static void omap_keys(struct test_key* keys, int nkeys)
+{
+    int c;
+
+    for (c = 0; c < nkeys; c++) {
+        keys[c].oid = 100 + 2 * (c / 3);
+        keys[c].sub = 10 + 5 * (c % 3);
+    }
+}
+
+/*
+ * The fstree keys have an inode, a xattr and an extent record for each
+ * object.
+ */
+static void fstree_keys(struct test_key* keys, int nkeys)
+{
+    static const u_int64_t types[] = {
+        APFS_TYPE_INODE, APFS_TYPE_XATTR, APFS_TYPE_FILE_EXTENT
+    };
+    int c;
+
+    for (c = 0; c < nkeys; c++) {
+        keys[c].oid = 100 + 2 * (c / 3);
+        keys[c].sub = types[c % 3];
+    }
+}
+
+static struct apfs_btree_node_phys_t* alloc_node(struct kunit* test,
+        int nkeys, int level, u_int16_t flags, size_t toc_size)
+{
+    struct apfs_btree_node_phys_t* node;
+
+    node = kunit_kzalloc(test, TEST_BLOCK_SIZE, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, node);
+
+    node->btn_flags = cpu_to_le16(flags | (level ? 0 : APFS_BTNODE_LEAF));
+    node->btn_level = cpu_to_le16(level);
+    node->btn_nkeys = cpu_to_le32(nkeys);
+    node->btn_table_space.off = 0;
+    node->btn_table_space.len = cpu_to_le16(nkeys * toc_size);
+
+    return node;
+}
+
+/*
+ * Build an omap node with the keys. The value of the key 'c' points to the
+ * block 1000 + c.
+ */
+static struct apfs_btree_node_phys_t* build_omap_node(struct kunit* test,
+        struct super_block* sb, struct test_key* keys, int nkeys, int level)
+{
+    struct apfs_btree_node_phys_t* node;
+    struct apfs_kvoff_t* toc;
+    struct apfs_omap_key_t* key;
+    struct apfs_omap_val_t* val;
+    u_int64_t* child;
+    int c;
+
+    node = alloc_node(test, nkeys, level, APFS_BTNODE_FIXED_KV_SIZE,
+            sizeof(*toc));
+    toc = (struct apfs_kvoff_t*) get_toc_zone(node);
+    key = (struct apfs_omap_key_t*) get_key_zone(node);
+
+    for (c = 0; c < nkeys; c++) {
+        toc[c].k = cpu_to_le16(c * sizeof(*key));
+        toc[c].v = cpu_to_le16((c + 1) * sizeof(*val));
+        key[c].ok_oid = cpu_to_le64(keys[c].oid);
+        key[c].ok_xid = cpu_to_le64(keys[c].sub);
+
+        if (level) {
+            child = (u_int64_t*) (get_val_zone(sb, node)
+                    - le16_to_cpu(toc[c].v));
+            *child = cpu_to_le64(1000 + c);
+        } else {
+            val = (struct apfs_omap_val_t*) (get_val_zone(sb, node)
+                    - le16_to_cpu(toc[c].v));
+            val->ov_paddr = cpu_to_le64(1000 + c);
+        }
+    }
+
+    return node;
+}
+
+static struct apfs_btree_node_phys_t* build_fstree_node(struct kunit* test,
+        struct test_key* keys, int nkeys, int level)
+{
+    struct apfs_btree_node_phys_t* node;
+    struct apfs_kvloc_t* toc;
+    struct apfs_record_key_t* key;
+    int c;
+
+    node = alloc_node(test, nkeys, level, 0, sizeof(*toc));
+    toc = (struct apfs_kvloc_t*) get_toc_zone(node);
+    key = (struct apfs_record_key_t*) get_key_zone(node);
+
+    for (c = 0; c < nkeys; c++) {
+        toc[c].k.off = cpu_to_le16(c * sizeof(*key));
+        toc[c].k.len = cpu_to_le16(sizeof(*key));
+        toc[c].v.off = cpu_to_le16((c + 1) * sizeof(u_int64_t));
+        toc[c].v.len = cpu_to_le16(sizeof(u_int64_t));
+        key[c].obj_id_and_type = cpu_to_le64(keys[c].oid
+                | (keys[c].sub << APFS_OBJ_TYPE_SHIFT));
+    }
+
+    return node;
+}
+
+static int cmp_test_keys(struct test_key* key, u_int64_t oid, u_int64_t sub)
+{
+    if (key->oid != oid)
+        return key->oid < oid ? -1 : 1;
+    if (key->sub != sub)
+        return key->sub < sub ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Reference search: the last key smaller or equal than the searched key.
+ * In the leaves of the omap, it must be a version of the same object; in
+ * the leaves of the fstree, it must be the same key.
+ */
+static int ref_search(struct test_key* keys, int nkeys, u_int64_t oid,
+        u_int64_t sub, int level, u_int8_t tree_type)
+{
+    int found, c;
+
+    found = -1;
+    for (c = 0; c < nkeys; c++)
+        if (cmp_test_keys(&keys[c], oid, sub) <= 0)
+            found = c;
+
+    if (found < 0 || level)
+        return found;
+
+    if (tree_type == APFS_OBJ_TYPE_OMAP)
+        return keys[found].oid == oid ? found : -1;
+
+    return cmp_test_keys(&keys[found], oid, sub) ? -1 : found;
+}
+
+/*
+ * Returns the position of the key found by find_in_node(), or -1.
+ */
+static int node_search(struct super_block* sb,
+        struct apfs_btree_node_phys_t* node, u_int64_t oid, u_int64_t sub,
+        u_int8_t tree_type)
+{
+    u_int8_t* toc;
+
+    toc = find_in_node(sb, node, oid, sub, NULL, tree_type);
+    if (!toc)
+        return -1;
+    if (tree_type == APFS_OBJ_TYPE_OMAP)
+        return (toc - get_toc_zone(node)) / sizeof(struct apfs_kvoff_t);
+    return (toc - get_toc_zone(node)) / sizeof(struct apfs_kvloc_t);
+}
+
+/*
+ * Search every object around the keys of the node, with values of 'sub'
+ * before, between and after the ones of the keys.
+ */
+static void check_node(struct kunit* test, struct super_block* sb,
+        struct apfs_btree_node_phys_t* node, struct test_key* keys,
+        int nkeys, int level, u_int8_t tree_type)
+{
+    u_int64_t oid, sub, max_oid, max_sub;
+    int expected, found;
+
+    max_oid = keys[nkeys - 1].oid + 2;
+    max_sub = tree_type == APFS_OBJ_TYPE_OMAP ? 25 : APFS_TYPE_DIR_REC;
+
+    for (oid = 98; oid <= max_oid; oid++) {
+        for (sub = 0; sub <= max_sub; sub++) {
+            expected = ref_search(keys, nkeys, oid, sub, level, tree_type);
+            found = node_search(sb, node, oid, sub, tree_type);
+            KUNIT_EXPECT_EQ_MSG(test, expected, found,
+                    "%s level %d, %d keys, search (%llu, %llu)",
+                    tree_type == APFS_OBJ_TYPE_OMAP ? "omap" : "fstree",
+                    level, nkeys, oid, sub);
+            if (expected != found)
+                return;
+        }
+    }
+}
+
+static const int test_node_sizes[] = {
+    1, 2, 3, 4, 5, 6, 7, 8, 15, 16, 17, 32, 63, 64, 100,
+    TEST_FSTREE_MAX_KEYS, TEST_OMAP_MAX_KEYS
+};
+
+static void find_in_omap_node_test(struct kunit* test)
+{
+    struct apfs_btree_node_phys_t* node;
+    struct super_block* sb;
+    struct test_key* keys;
+    int nkeys, level, c;
+
+    sb = test_sb(test);
+    keys = kunit_kcalloc(test, TEST_OMAP_MAX_KEYS, sizeof(*keys), GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, keys);
+    omap_keys(keys, TEST_OMAP_MAX_KEYS);
+
+    for (c = 0; c < ARRAY_SIZE(test_node_sizes); c++) {
+        nkeys = min_t(int, test_node_sizes[c], TEST_OMAP_MAX_KEYS);
+        for (level = 0; level <= 1; level++) {
+            node = build_omap_node(test, sb, keys, nkeys, level);
+            check_node(test, sb, node, keys, nkeys, level,
+                    APFS_OBJ_TYPE_OMAP);
+        }
+    }
+}
+
+static void find_in_fstree_node_test(struct kunit* test)
+{
+    struct apfs_btree_node_phys_t* node;
+    struct super_block* sb;
+    struct test_key* keys;
+    int nkeys, level, c;
+
+    sb = test_sb(test);
+    keys = kunit_kcalloc(test, TEST_FSTREE_MAX_KEYS, sizeof(*keys),
+            GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, keys);
+    fstree_keys(keys, TEST_FSTREE_MAX_KEYS);
+
+    for (c = 0; c < ARRAY_SIZE(test_node_sizes); c++) {
+        nkeys = min_t(int, test_node_sizes[c], TEST_FSTREE_MAX_KEYS);
+        for (level = 0; level <= 1; level++) {
+            node = build_fstree_node(test, keys, nkeys, level);
+            check_node(test, sb, node, keys, nkeys, level,
+                    APFS_OBJ_TYPE_FSTREE);
+        }
+    }
+}
+
+/*
+ * The value of the key found in the leaves is the block of the version.
+ */
+static void omap_value_test(struct kunit* test)
+{
+    struct apfs_btree_node_phys_t* node;
+    struct super_block* sb;
+    struct test_key keys[9];
+    u_int8_t* toc;
+    int level;
+
+    sb = test_sb(test);
+    omap_keys(keys, ARRAY_SIZE(keys));
+
+    for (level = 0; level <= 1; level++) {
+        node = build_omap_node(test, sb, keys, ARRAY_SIZE(keys), level);
+
+        /* (102, 17) sees the version (102, 15) */
+        toc = find_in_node(sb, node, 102, 17, NULL, APFS_OBJ_TYPE_OMAP);
+        KUNIT_ASSERT_NOT_NULL(test, toc);
+        KUNIT_EXPECT_EQ(test, 1004ULL, get_omap_value(sb, node,
+                    (struct apfs_kvoff_t*) toc));
+    }
+}
+
+struct cmp_omap_case {
+    u_int64_t oid, xid, oid_c, xid_c;
+    int leaf, nonleaf;
+};
+
+static void cmp_omap_toc_keys_test(struct kunit* test)
+{
+    static const struct cmp_omap_case cases[] = {
+        { 5, 5, 5, 5,  0,  0 },     /* Same version */
+        { 5, 7, 5, 5,  2,  2 },     /* Newer xid: may be the version */
+        { 5, 3, 5, 5, -1, -1 },     /* Older xid: the key is greater */
+        { 6, 1, 5, 5,  1,  2 },     /* Greater oid */
+        { 4, 9, 5, 5, -1, -1 },     /* Smaller oid */
+    };
+    const struct cmp_omap_case* c;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(cases); i++) {
+        c = &cases[i];
+        KUNIT_EXPECT_EQ_MSG(test, c->leaf, cmp_omap_toc_keys(c->oid,
+                    c->xid, c->oid_c, c->xid_c, CMP_NODE_LEAF),
+                "leaf case %d", i);
+        KUNIT_EXPECT_EQ_MSG(test, c->nonleaf, cmp_omap_toc_keys(c->oid,
+                    c->xid, c->oid_c, c->xid_c, CMP_NODE_NONLEAF),
+                "non-leaf case %d", i);
+    }
+}
+
+struct cmp_fstree_case {
+    u_int64_t oid, type;
+    char* name;
+    u_int64_t oid_c, type_c;
+    char* name_c;
+    int leaf, nonleaf;
+};
+
+static void cmp_fstree_toc_keys_test(struct kunit* test)
+{
+    static const struct cmp_fstree_case cases[] = {
+        { 5, 3, NULL, 5, 3, NULL,  0,  0 },
+        { 5, 4, NULL, 5, 3, NULL,  1,  2 },
+        { 5, 3, NULL, 5, 4, NULL, -1, -1 },
+        { 6, 1, NULL, 5, 9, NULL,  1,  2 },
+        { 4, 9, NULL, 5, 1, NULL, -1, -1 },
+        { 5, 9, "a",  5, 9, "a",   0,  0 },
+        { 5, 9, "a",  5, 9, "b",  -1, -1 },
+        { 5, 9, "b",  5, 9, "a",   1,  2 },
+        { 5, 9, "ab", 5, 9, "a",   1,  2 },
+    };
+    const struct cmp_fstree_case* c;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(cases); i++) {
+        c = &cases[i];
+        KUNIT_EXPECT_EQ_MSG(test, c->leaf, cmp_fstree_toc_keys(c->oid,
+                    c->type, c->name, c->oid_c, c->type_c, c->name_c,
+                    CMP_NODE_LEAF),
+                "leaf case %d", i);
+        KUNIT_EXPECT_EQ_MSG(test, c->nonleaf, cmp_fstree_toc_keys(c->oid,
+                    c->type, c->name, c->oid_c, c->type_c, c->name_c,
+                    CMP_NODE_NONLEAF),
+                "non-leaf case %d", i);
+    }
+}
+
+/*
+ * Build an inode record with the extended fields 'types' of the sizes
+ * 'sizes'. The data of the dstream field has the size 'size'.
+ */
+static struct apfs_record_inode_val_t* build_inode(struct kunit* test,
+        const u_int8_t* types, const u_int16_t* sizes, int count,
+        u_int64_t size)
+{
+    struct apfs_record_inode_val_t* inode;
+    struct apfs_xf_blob_t* xf_blob;
+    struct apfs_dstream_t* dstream;
+    u_int8_t* data;
+    int c;
+
+    inode = kunit_kzalloc(test, 512, GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, inode);
+
+    xf_blob = (struct apfs_xf_blob_t*) inode->xfields;
+    xf_blob->xf_num_exts = cpu_to_le16(count);
+    data = (u_int8_t*) &xf_blob->xf_data[count];
+
+    for (c = 0; c < count; c++) {
+        xf_blob->xf_data[c].x_type = types[c];
+        xf_blob->xf_data[c].x_size = cpu_to_le16(sizes[c]);
+        if (types[c] == APFS_INO_EXT_TYPE_DSTREAM) {
+            dstream = (struct apfs_dstream_t*) data;
+            dstream->size = cpu_to_le64(size);
+        } else {
+            memset(data, 0xff, sizes[c]);
+        }
+        data += round_up(sizes[c], 8);
+    }
+
+    return inode;
+}
+
+static void get_inode_size_test(struct kunit* test)
+{
+    static const u_int8_t dstream_only[] = { APFS_INO_EXT_TYPE_DSTREAM };
+    static const u_int16_t dstream_only_sizes[] = {
+        sizeof(struct apfs_dstream_t)
+    };
+    static const u_int8_t after_name[] = { 4, APFS_INO_EXT_TYPE_DSTREAM };
+    static const u_int16_t after_name_sizes[] = {
+        5, sizeof(struct apfs_dstream_t)
+    };
+    static const u_int8_t no_dstream[] = { 4 };
+    static const u_int16_t no_dstream_sizes[] = { 12 };
+    struct apfs_record_inode_val_t* inode;
+
+    inode = build_inode(test, NULL, NULL, 0, 0);
+    KUNIT_EXPECT_EQ(test, 0ULL, get_inode_size(inode));
+
+    inode = build_inode(test, dstream_only, dstream_only_sizes, 1, 12345);
+    KUNIT_EXPECT_EQ(test, 12345ULL, get_inode_size(inode));
+
+    inode = build_inode(test, after_name, after_name_sizes, 2, 1ULL << 40);
+    KUNIT_EXPECT_EQ(test, 1ULL << 40, get_inode_size(inode));
+
+    inode = build_inode(test, no_dstream, no_dstream_sizes, 1, 0);
+    KUNIT_EXPECT_EQ(test, 0ULL, get_inode_size(inode));
+}
+
+/*
+ * Time TEST_BENCH_SEARCHES searches of random keys in the node. Returns
+ * the ns per search.
+ */
+static u_int64_t bench_node(struct super_block* sb,
+        struct apfs_btree_node_phys_t* node, struct test_key* keys,
+        int nkeys, u_int8_t tree_type)
+{
+    struct test_key* key;
+    u_int64_t start, elapsed;
+    u_int32_t seed;
+    int c, found;
+
+    seed = 1;
+    found = 0;
+    start = ktime_get_ns();
+    for (c = 0; c < TEST_BENCH_SEARCHES; c++) {
+        seed = seed * 1103515245 + 12345;
+        key = &keys[(seed >> 8) % nkeys];
+        if (find_in_node(sb, node, key->oid, key->sub, NULL, tree_type))
+            found++;
+    }
+    elapsed = ktime_get_ns() - start;
+
+    return found ? div_u64(elapsed, TEST_BENCH_SEARCHES) : 0;
+}
+
+static void find_in_node_bench(struct kunit* test)
+{
+    static const int fills[] = { 10, 25, 50, 75, 100 };
+    struct apfs_btree_node_phys_t* node;
+    struct super_block* sb;
+    struct test_key* omap;
+    struct test_key* fstree;
+    int nkeys, level, c;
+
+    sb = test_sb(test);
+    omap = kunit_kcalloc(test, TEST_OMAP_MAX_KEYS, sizeof(*omap), GFP_KERNEL);
+    fstree = kunit_kcalloc(test, TEST_FSTREE_MAX_KEYS, sizeof(*fstree),
+            GFP_KERNEL);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, omap);
+    KUNIT_ASSERT_NOT_ERR_OR_NULL(test, fstree);
+    omap_keys(omap, TEST_OMAP_MAX_KEYS);
+    fstree_keys(fstree, TEST_FSTREE_MAX_KEYS);
+
+    for (c = 0; c < ARRAY_SIZE(fills); c++) {
+        for (level = 0; level <= 1; level++) {
+            nkeys = max_t(int, 1, TEST_OMAP_MAX_KEYS * fills[c] / 100);
+            node = build_omap_node(test, sb, omap, nkeys, level);
+            kunit_info(test, "omap %-5s %3d%% (%3d keys): %llu ns/search\n",
+                    level ? "index" : "leaf", fills[c], nkeys,
+                    bench_node(sb, node, omap, nkeys, APFS_OBJ_TYPE_OMAP));
+
+            nkeys = max_t(int, 1, TEST_FSTREE_MAX_KEYS * fills[c] / 100);
+            node = build_fstree_node(test, fstree, nkeys, level);
+            kunit_info(test, "fstree %-5s %3d%% (%3d keys): %llu ns/search\n",
+                    level ? "index" : "leaf", fills[c], nkeys,
+                    bench_node(sb, node, fstree, nkeys, APFS_OBJ_TYPE_FSTREE));
+        }
+    }
+}
+
+static struct kunit_case apfs_util_test_cases[] = {
+    KUNIT_CASE(cmp_omap_toc_keys_test),
+    KUNIT_CASE(cmp_fstree_toc_keys_test),
+    KUNIT_CASE(find_in_omap_node_test),
+    KUNIT_CASE(find_in_fstree_node_test),
+    KUNIT_CASE(omap_value_test),
+    KUNIT_CASE(get_inode_size_test),
+    KUNIT_CASE(find_in_node_bench),
+    {}
+};
+
+static struct kunit_suite apfs_util_test_suite = {
+    .name = "apfs-util",
+    .test_cases = apfs_util_test_cases,
+};
+
+/*
+ * In a module, kunit_test_suite() defines a module_init() of its own that
+ * clashes with the one of super.c, so the suites are run when the module
+ * is loaded by init_apfs_fs().
+ */
+static struct kunit_suite* apfs_test_suites[] = {
+    &apfs_util_test_suite,
+    NULL
+};
+
+void apfs_kunit_init(void)
+{
+    __kunit_test_suites_init(apfs_test_suites);
+}
+
+void apfs_kunit_exit(void)
+{
+    __kunit_test_suites_exit(apfs_test_suites);
+}
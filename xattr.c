@@ -0,0 +1,521 @@
+/*
+ * This file is part of the APFS-Module.
+ * Copyright (c) 2019 Jordi Barcons.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/xattr.h>
+
+#include "apfs.h"
+#include "apfs/volume.h"
+
+/*
+ * The values of the stream-backed xattrs bigger than this size are not
+ * kept in the cache (e.g. resource forks). They are read from the disk by
+ * each getxattr, so listing the xattrs doesn't read their values.
+ */
+#define APFS_XATTR_CACHE_MAX_VALUE  4096
+
+/*
+ * Growable array used while the xattr records are collected.
+ */
+struct xattr_list {
+    int count;
+    int size;
+    struct apfs_xattr* xattrs;
+};
+
+/*
+ * Decode a xattr record and add it to the list. The lengths of the name and
+ * of the data are checked against the ones of the record.
+ */
+static int add_xattr(struct xattr_list* list,
+        struct apfs_record_xattr_key_t* key, int key_len,
+        struct apfs_record_xattr_val_t* val, int val_len)
+{
+    struct apfs_xattr_dstream_t* xds;
+    struct apfs_xattr* xattrs;
+    struct apfs_xattr* x;
+    u_int16_t name_len;
+    u_int16_t xdata_len;
+    u_int16_t flags;
+
+    if (key_len < sizeof(*key) || val_len < sizeof(*val))
+        goto corrupted;
+    name_len = le16_to_cpu(key->name_len);
+    xdata_len = le16_to_cpu(val->xdata_len);
+    flags = le16_to_cpu(val->flags);
+    if (sizeof(*key) + name_len > key_len
+            || sizeof(*val) + xdata_len > val_len
+            || ((flags & APFS_XATTR_DATA_STREAM)
+                && xdata_len < sizeof(*xds)))
+        goto corrupted;
+
+    if (list->count == list->size) {
+        list->size = list->size ? list->size * 2 : 4;
+        xattrs = krealloc(list->xattrs, list->size * sizeof(*xattrs),
+                GFP_KERNEL);
+        if (!xattrs)
+            return -ENOMEM;
+        list->xattrs = xattrs;
+    }
+
+    x = &list->xattrs[list->count];
+    memset(x, 0, sizeof(*x));
+
+    /*
+     * The name length on disk includes the null character.
+     */
+    x->name = kmalloc(name_len + 1, GFP_KERNEL);
+    if (!x->name)
+        return -ENOMEM;
+    memcpy(x->name, key->name, name_len);
+    x->name[name_len] = '\0';
+    x->name_len = strlen(x->name);
+
+    x->flags = flags;
+
+    if (flags & APFS_XATTR_DATA_STREAM) {
+        xds = (struct apfs_xattr_dstream_t*) val->xdata;
+        x->stream_oid = le64_to_cpu(xds->xattr_obj_id);
+        x->size = le64_to_cpu(xds->dstream.size);
+    } else {
+        x->size = xdata_len;
+        x->value = kmemdup(val->xdata, x->size, GFP_KERNEL);
+        if (!x->value && x->size) {
+            kfree(x->name);
+            return -ENOMEM;
+        }
+    }
+
+    list->count++;
+    return 0;
+
+corrupted:
+    printk(KERN_ERR "apfs: invalid xattr record\n");
+    return -EFSCORRUPTED;
+}
+
+/*
+ * Collect all the APFS_TYPE_XATTR records of the inode. They follow the
+ * inode record, so the seek starts in the leaf of the inode record.
+ */
+static int collect_xattrs(struct inode* inode, struct xattr_list* list)
+{
+    struct apfs_btree_cursor cur;
+    struct apfs_record_xattr_key_t* xattr_key;
+    struct apfs_record_xattr_val_t* xattr_val;
+    int key_len;
+    int val_len;
+    int ret;
+
+    apfs_fstree_cursor_init(&cur, inode->i_sb);
+    apfs_btree_cursor_hint(&cur, &APFS_I(inode)->rec_hint);
+
+    for (ret = apfs_btree_range_first(&cur, inode->i_ino, APFS_TYPE_XATTR);
+            ret > 0; ret = apfs_btree_range_next(&cur)) {
+        xattr_key = (struct apfs_record_xattr_key_t*)
+            apfs_btree_key(&cur, &key_len);
+        xattr_val = (struct apfs_record_xattr_val_t*)
+            apfs_btree_val(&cur, &val_len);
+
+        ret = add_xattr(list, xattr_key, key_len, xattr_val, val_len);
+        if (ret)
+            break;
+    }
+
+    apfs_btree_cursor_release(&cur);
+
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Copy the data of the stream 'oid' to 'buf' following its
+ * APFS_TYPE_FILE_EXTENT records. The buffer is cleared first, so the holes
+ * and the bytes not covered by any extent read as zeros.
+ */
+static int read_stream_data(struct super_block* sb, u_int64_t oid,
+        u_int8_t* buf, u_int64_t size)
+{
+    struct apfs_buf* blk;
+    struct apfs_btree_cursor cur;
+    struct apfs_record_file_extent_key_t* ext_key;
+    struct apfs_record_file_extent_val_t* ext_val;
+    u_int64_t logical, ext_len, phys, pos, end, off;
+    size_t bytes;
+    int len;
+    int ret;
+
+    memset(buf, 0, size);
+    apfs_fstree_cursor_init(&cur, sb);
+
+    for (ret = apfs_btree_range_first(&cur, oid, APFS_TYPE_FILE_EXTENT);
+            ret > 0; ret = apfs_btree_range_next(&cur)) {
+        ext_key = (struct apfs_record_file_extent_key_t*) apfs_btree_key(&cur, &len);
+        ext_val = (struct apfs_record_file_extent_val_t*) apfs_btree_val(&cur, &len);
+
+        logical = le64_to_cpu(ext_key->logical_addr);
+        ext_len = le64_to_cpu(ext_val->len_and_flags)
+            & APFS_RECORD_FILE_EXTENT_LEN_MASK;
+        phys = le64_to_cpu(ext_val->phys_block_num);
+        end = min(logical + ext_len, size);
+
+        /*
+         * A physical block number of zero is a hole.
+         */
+        if (phys == 0)
+            continue;
+
+        for (pos = logical; pos < end; pos += bytes) {
+            off = (pos - logical) % sb->s_blocksize;
+            bytes = min_t(u_int64_t, sb->s_blocksize - off, end - pos);
+            blk = apfs_read_block(sb, phys + (pos - logical) / sb->s_blocksize);
+            if (!blk) {
+                printk(KERN_ERR "apfs: unable to read xattr stream [%llu]\n",
+                        oid);
+                ret = -EIO;
+                goto out;
+            }
+            memcpy(buf + pos, (u_int8_t*) blk->data + off, bytes);
+            apfs_release_block(blk);
+        }
+    }
+
+out:
+    apfs_btree_cursor_release(&cur);
+
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Read the value of a stream-backed xattr.
+ */
+static int read_xattr_stream(struct super_block* sb, struct apfs_xattr* x,
+        u_int8_t* buf)
+{
+    return read_stream_data(sb, x->stream_oid, buf, x->size);
+}
+
+static void free_xattrs_rcu(struct rcu_head* head)
+{
+    struct apfs_xattr_cache* cache;
+    int c;
+
+    cache = container_of(head, struct apfs_xattr_cache, rcu);
+    for (c = 0; c < cache->count; c++) {
+        kfree(cache->xattrs[c].name);
+        kvfree(cache->xattrs[c].value);
+    }
+    kfree(cache);
+}
+
+/*
+ * Release a reference of a xattr cache. The readers take their reference
+ * under RCU, so the cache is freed after a grace period.
+ */
+static void put_xattrs(struct apfs_xattr_cache* cache)
+{
+    if (cache && refcount_dec_and_test(&cache->refcnt))
+        call_rcu(&cache->rcu, free_xattrs_rcu);
+}
+
+/*
+ * Detach the xattr cache of the inode. The caller must hold the lock of
+ * the LRU list and put the returned cache.
+ */
+static struct apfs_xattr_cache* detach_xattrs(struct apfs_inode_lru* lru,
+        struct apfs_inode_info* ai)
+{
+    struct apfs_xattr_cache* cache;
+
+    cache = rcu_dereference_protected(ai->xattrs, lockdep_is_held(&lru->lock));
+    if (!cache)
+        return NULL;
+
+    RCU_INIT_POINTER(ai->xattrs, NULL);
+    list_del_init(&ai->xattr_lru);
+    lru->count--;
+
+    return cache;
+}
+
+static bool xattrs_evict(struct list_head* entry, void* arg)
+{
+    struct apfs_inode_info* ai;
+
+    ai = list_entry(entry, struct apfs_inode_info, xattr_lru);
+    if (test_and_clear_bit(APFS_XATTRS_REFERENCED, &ai->flags))
+        return false;
+
+    put_xattrs(detach_xattrs((struct apfs_inode_lru*) arg, ai));
+
+    return true;
+}
+
+/*
+ * Release the xattr caches of up to 'nr' inodes from the LRU list. Returns
+ * the number of caches released.
+ */
+unsigned long apfs_xattr_lru_shrink(struct apfs_inode_lru* lru,
+        unsigned long nr)
+{
+    unsigned long freed;
+
+    spin_lock(&lru->lock);
+    freed = apfs_lru_walk(&lru->list, lru->count, nr, xattrs_evict, lru);
+    spin_unlock(&lru->lock);
+
+    return freed;
+}
+
+/*
+ * Release the xattr cache of an inode that is being destroyed.
+ */
+void apfs_drop_xattrs(struct inode* inode)
+{
+    struct apfs_glb_info* glb_info;
+    struct apfs_inode_lru* lru;
+
+    glb_info = (struct apfs_glb_info*) inode->i_sb->s_fs_info;
+    lru = &glb_info->xattr_lru;
+
+    spin_lock(&lru->lock);
+    put_xattrs(detach_xattrs(lru, APFS_I(inode)));
+    spin_unlock(&lru->lock);
+}
+
+/*
+ * Read all the xattrs of the inode from the disk and build the cache.
+ */
+static struct apfs_xattr_cache* load_xattrs(struct inode* inode)
+{
+    struct super_block* sb;
+    struct apfs_xattr_cache* cache;
+    struct apfs_xattr* x;
+    struct xattr_list list;
+    int err, c;
+
+    sb = inode->i_sb;
+    memset(&list, 0, sizeof(list));
+
+    err = collect_xattrs(inode, &list);
+    if (err)
+        goto free_list;
+
+    /*
+     * The small stream-backed values are also cached.
+     */
+    for (c = 0; c < list.count; c++) {
+        x = &list.xattrs[c];
+        if (!(x->flags & APFS_XATTR_DATA_STREAM)
+                || x->size > APFS_XATTR_CACHE_MAX_VALUE)
+            continue;
+
+        x->value = kvmalloc(x->size, GFP_KERNEL);
+        if (!x->value) {
+            err = -ENOMEM;
+            goto free_list;
+        }
+        err = read_xattr_stream(sb, x, x->value);
+        if (err)
+            goto free_list;
+    }
+
+    cache = kmalloc(struct_size(cache, xattrs, list.count), GFP_KERNEL);
+    if (!cache) {
+        err = -ENOMEM;
+        goto free_list;
+    }
+    refcount_set(&cache->refcnt, 1);
+    cache->count = list.count;
+    if (list.count)
+        memcpy(cache->xattrs, list.xattrs, list.count * sizeof(*x));
+    kfree(list.xattrs);
+
+    return cache;
+
+free_list:
+    for (c = 0; c < list.count; c++) {
+        kfree(list.xattrs[c].name);
+        kvfree(list.xattrs[c].value);
+    }
+    kfree(list.xattrs);
+    return ERR_PTR(err);
+}
+
+/*
+ * Take a reference of the cached xattrs of the inode. Returns NULL if they
+ * aren't cached.
+ */
+static struct apfs_xattr_cache* grab_xattrs(struct apfs_inode_info* ai)
+{
+    struct apfs_xattr_cache* cache;
+
+    rcu_read_lock();
+    cache = rcu_dereference(ai->xattrs);
+    if (cache && !refcount_inc_not_zero(&cache->refcnt))
+        cache = NULL;
+    rcu_read_unlock();
+
+    return cache;
+}
+
+/*
+ * Returns the xattrs of the inode, which must be released with
+ * put_xattrs(). They are read from the disk the first time and kept in the
+ * inode until the shrinker or the limit of the LRU list release them.
+ */
+static struct apfs_xattr_cache* get_xattrs(struct inode* inode)
+{
+    struct apfs_glb_info* glb_info;
+    struct apfs_inode_lru* lru;
+    struct apfs_inode_info* ai;
+    struct apfs_xattr_cache* cache;
+    unsigned long over;
+
+    glb_info = (struct apfs_glb_info*) inode->i_sb->s_fs_info;
+    lru = &glb_info->xattr_lru;
+    ai = APFS_I(inode);
+
+    cache = grab_xattrs(ai);
+    if (cache) {
+        if (!test_bit(APFS_XATTRS_REFERENCED, &ai->flags))
+            set_bit(APFS_XATTRS_REFERENCED, &ai->flags);
+        return cache;
+    }
+
+    over = 0;
+    mutex_lock(&ai->xattr_lock);
+    cache = grab_xattrs(ai);
+    if (!cache) {
+        cache = load_xattrs(inode);
+        if (!IS_ERR(cache)) {
+            /*
+             * One reference for the inode and one for the caller.
+             */
+            refcount_inc(&cache->refcnt);
+            spin_lock(&lru->lock);
+            rcu_assign_pointer(ai->xattrs, cache);
+            list_add(&ai->xattr_lru, &lru->list);
+            lru->count++;
+            if (lru->count > lru->max)
+                over = lru->count - lru->max;
+            spin_unlock(&lru->lock);
+        }
+    }
+    mutex_unlock(&ai->xattr_lock);
+
+    if (over)
+        apfs_xattr_lru_shrink(lru, over);
+
+    return cache;
+}
+
+/*
+ * Copy the value of the xattr 'name' to the buffer. If the buffer is NULL,
+ * returns the size of the value.
+ */
+int apfs_xattr_get(struct inode* inode, const char* name, void* buffer,
+        size_t size)
+{
+    struct apfs_xattr_cache* cache;
+    struct apfs_xattr* x;
+    int ret, c;
+
+    cache = get_xattrs(inode);
+    if (IS_ERR(cache))
+        return PTR_ERR(cache);
+
+    ret = -ENODATA;
+    for (c = 0; c < cache->count; c++) {
+        x = &cache->xattrs[c];
+        if (strcmp(x->name, name))
+            continue;
+
+        if (x->size > XATTR_SIZE_MAX)
+            ret = -E2BIG;
+        else if (!buffer)
+            ret = x->size;
+        else if (size < x->size)
+            ret = -ERANGE;
+        else if (x->value) {
+            memcpy(buffer, x->value, x->size);
+            ret = x->size;
+        } else if (read_xattr_stream(inode->i_sb, x, buffer))
+            ret = -EIO;
+        else
+            ret = x->size;
+        break;
+    }
+
+    put_xattrs(cache);
+    return ret;
+}
+
+static int apfs_xattr_osx_get(const struct xattr_handler* handler,
+        struct dentry* unused, struct inode* inode, const char* name,
+        void* buffer, size_t size)
+{
+    return apfs_xattr_get(inode, name, buffer, size);
+}
+
+/*
+ * The names of the xattrs are exported with the "osx." prefix, as the
+ * names used by macOS don't belong to any linux namespace.
+ */
+ssize_t apfs_listxattr(struct dentry* dentry, char* buffer, size_t size)
+{
+    struct apfs_xattr_cache* cache;
+    struct apfs_xattr* x;
+    size_t len;
+    ssize_t total;
+    int c;
+
+    cache = get_xattrs(d_inode(dentry));
+    if (IS_ERR(cache))
+        return PTR_ERR(cache);
+
+    total = 0;
+    for (c = 0; c < cache->count; c++) {
+        x = &cache->xattrs[c];
+        len = XATTR_MAC_OSX_PREFIX_LEN + x->name_len + 1;
+
+        if (buffer) {
+            if (total + len > size) {
+                total = -ERANGE;
+                break;
+            }
+            memcpy(buffer + total, XATTR_MAC_OSX_PREFIX,
+                    XATTR_MAC_OSX_PREFIX_LEN);
+            memcpy(buffer + total + XATTR_MAC_OSX_PREFIX_LEN, x->name,
+                    x->name_len + 1);
+        }
+        total += len;
+    }
+
+    put_xattrs(cache);
+    return total;
+}
+
+static const struct xattr_handler apfs_xattr_osx_handler = {
+    .prefix = XATTR_MAC_OSX_PREFIX,
+    .get = apfs_xattr_osx_get,
+};
+
+const struct xattr_handler* apfs_xattr_handlers[] = {
+    &apfs_xattr_osx_handler,
+    NULL
+};